@@ -0,0 +1,315 @@
+/* See LICENSE. */
+
+/* The helper for "make bench": runs and times things, and is also the
+ * (static) program in the tiny benchmark rootfs. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static void __attribute__((noreturn)) perror_msg_and_die2(const char* msg, const char *extra) {
+	if (extra) fprintf(stderr,"%s: ", extra);
+	perror(msg);
+	exit(1);
+}
+
+static void __attribute__((noreturn)) perror_msg_and_die(const char* msg) {
+	perror_msg_and_die2(msg, NULL);
+}
+
+static void __attribute__((noreturn)) error_msg_and_die(const char* msg) {
+	fprintf(stderr,"%s\n", msg);
+	exit(1);
+}
+
+static int64_t monotime_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int i64_cmp(const void *a, const void *b) {
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* One result line: name unit n p50 p90 p99 max, the values in ns are
+ * scaled to the unit. The format is stable, so results can be diffed. */
+static void report(const char *name, const char *unit, int64_t *v, int n) {
+	int64_t div = strcmp(unit, "us") == 0 ? 1000 : 1;
+	qsort(v, n, sizeof(*v), i64_cmp);
+	printf("%s\t%s\t%d", name, unit, n);
+	int q[] = { 50, 90, 99, 100 };
+	for (int i=0;i<4;i++) {
+		int64_t x = v[((n-1) * q[i]) / 100];
+		printf("\t%lld.%lld", (long long)(x / div), (long long)((x % div) * 10 / div));
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static pid_t spawn(char **argv, int out) {
+	pid_t p = fork();
+	if (p == -1) perror_msg_and_die("fork");
+	if (!p) {
+		if (out != 1) dup2(out, 1);
+		execv(argv[0], argv);
+		perror_msg_and_die2("execv", argv[0]);
+	}
+	return p;
+}
+
+/* run [-n n] [-j jobs] name cmd...: run cmd n times, jobs at a time.
+ * Reports the latency of each, and if -j is given also the rate per second. */
+static int bench_run(int argc, char **argv) {
+	int n = 100, jobs = 1, rate = 0, opt;
+	while ((opt = getopt(argc, argv, "+n:j:")) != -1) {
+		switch (opt) {
+			default: error_msg_and_die("usage: run [-n n] [-j jobs] name cmd...");
+			case 'n': n = atoi(optarg); break;
+			case 'j': jobs = atoi(optarg); rate = 1; break;
+		}
+	}
+	if ((argc - optind < 2)||(n < 1)||(jobs < 1)) error_msg_and_die("run: bad arguments");
+	char *name = argv[optind];
+	char **cmd = argv + optind + 1;
+	int null = open("/dev/null", O_WRONLY);
+	if (null < 0) perror_msg_and_die("/dev/null");
+
+	/* A warmup run, for the page cache and such. */
+	int st;
+	waitpid(spawn(cmd, null), &st, 0);
+	if ((!WIFEXITED(st))||(WEXITSTATUS(st))) {
+		fprintf(stderr, "%s: the command failed\n", name);
+		exit(1);
+	}
+
+	int64_t *t = calloc(n, sizeof(*t));
+	pid_t *pids = calloc(jobs, sizeof(*pids));
+	int64_t *start = calloc(jobs, sizeof(*start));
+	if ((!t)||(!pids)||(!start)) perror_msg_and_die("calloc");
+	int started = 0, done = 0, running = 0, fails = 0;
+	int64_t t0 = monotime_ns();
+	while (done < n) {
+		while ((running < jobs)&&(started < n)) {
+			int j = 0;
+			while (pids[j]) j++;
+			start[j] = monotime_ns();
+			pids[j] = spawn(cmd, null);
+			started++;
+			running++;
+		}
+		pid_t r = wait(&st);
+		if (r < 0) perror_msg_and_die("wait");
+		int64_t now = monotime_ns();
+		for (int j=0;j<jobs;j++) {
+			if (pids[j] != r) continue;
+			t[done++] = now - start[j];
+			pids[j] = 0;
+			running--;
+			if ((!WIFEXITED(st))||(WEXITSTATUS(st))) fails++;
+			break;
+		}
+	}
+	int64_t total = monotime_ns() - t0;
+	if (fails) fprintf(stderr, "%s: %d of %d runs failed\n", name, fails, n);
+	report(name, "us", t, n);
+	if (rate) {
+		int64_t r = (int64_t)n * 1000000000LL / (total ? total : 1);
+		printf("%s.rate\t/s\t%d\t%lld\t-\t-\t-\n", name, n, (long long)r);
+	}
+	return 0;
+}
+
+/* exit [-n n] pidfile name cmd...: how long after the last process in the
+ * namespace ends does its init go away. The command must leave behind a
+ * process that prints a timestamp (see bgstamp) when it is about to exit,
+ * and the pid of the init must be in pidfile after the command returns. */
+static int bench_exit(int argc, char **argv) {
+	int n = 50, opt;
+	while ((opt = getopt(argc, argv, "+n:")) != -1) {
+		switch (opt) {
+			default: error_msg_and_die("usage: exit [-n n] pidfile name cmd...");
+			case 'n': n = atoi(optarg); break;
+		}
+	}
+	if ((argc - optind < 3)||(n < 1)) error_msg_and_die("exit: bad arguments");
+	char *pidfile = argv[optind];
+	char *name = argv[optind+1];
+	char **cmd = argv + optind + 2;
+	int64_t *t = calloc(n, sizeof(*t));
+	if (!t) perror_msg_and_die("calloc");
+	for (int i=0;i<n;i++) {
+		int pp[2];
+		if (pipe(pp) != 0) perror_msg_and_die("pipe");
+		pid_t p = spawn(cmd, pp[1]);
+		close(pp[1]);
+		int st;
+		waitpid(p, &st, 0);
+
+		char buf[32];
+		FILE *f = fopen(pidfile, "r");
+		int pid = 0;
+		if ((!f)||(fscanf(f, "%d", &pid) != 1)) {
+			fprintf(stderr, "%s: no pid in %s\n", name, pidfile);
+			exit(1);
+		}
+		fclose(f);
+		int pfd = syscall(SYS_pidfd_open, pid, 0);
+
+		/* The stamp comes right before the last process exits. */
+		int l = 0, r;
+		while ((r = read(pp[0], buf+l, sizeof(buf)-1-l)) > 0) l += r;
+		close(pp[0]);
+		buf[l] = 0;
+		int64_t stamp = atoll(buf);
+		if (!stamp) error_msg_and_die("exit: no timestamp from the command");
+		if (pfd >= 0) {
+			struct pollfd pf = { .fd = pfd, .events = POLLIN };
+			while ((poll(&pf, 1, -1) < 0)&&(errno == EINTR));
+			close(pfd);
+		}
+		/* If the init was gone before we got to look, this is just an upper bound. */
+		t[i] = monotime_ns() - stamp;
+	}
+	report(name, "us", t, n);
+	return 0;
+}
+
+/* syscalls [-n n] [-r rounds] name: the cost of a getppid() and of
+ * a (failing) fchown(), per call. Run this under a filter to see its cost. */
+static int bench_syscalls(int argc, char **argv) {
+	int n = 200000, rounds = 21, opt;
+	while ((opt = getopt(argc, argv, "+n:r:")) != -1) {
+		switch (opt) {
+			default: error_msg_and_die("usage: syscalls [-n n] [-r rounds] name");
+			case 'n': n = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+		}
+	}
+	if ((argc - optind < 1)||(n < 1)||(rounds < 1)) error_msg_and_die("syscalls: bad arguments");
+	char *name = argv[optind];
+	char rn[128];
+	int64_t *t = calloc(rounds, sizeof(*t));
+	if (!t) perror_msg_and_die("calloc");
+	for (int k=0;k<2;k++) {
+		for (int i=0;i<rounds;i++) {
+			int64_t s = monotime_ns();
+			for (int j=0;j<n;j++) {
+				if (k) syscall(SYS_fchown, -1, -1, -1);
+				else syscall(SYS_getppid);
+			}
+			t[i] = (monotime_ns() - s) / n;
+		}
+		snprintf(rn, sizeof(rn), "%s.%s", name, k ? "fchown" : "getppid");
+		report(rn, "ns", t, rounds);
+	}
+	return 0;
+}
+
+/* procfs dir n: make a procfs lookalike with n processes for pidsearch. */
+static int bench_procfs(int argc, char **argv) {
+	if (argc < 3) error_msg_and_die("usage: procfs dir n");
+	int n = atoi(argv[2]);
+	char fn[64];
+	if ((mkdir(argv[1], 0755) != 0)&&(errno != EEXIST)) perror_msg_and_die2("mkdir", argv[1]);
+	int dfd = open(argv[1], O_PATH|O_DIRECTORY);
+	if (dfd < 0) perror_msg_and_die2("open", argv[1]);
+	static const char *names[] = { "bash", "sleep", "kworker/0:1", "sshd", "make", "cc1", "init", "ld" };
+	for (int i=1;i<=n;i++) {
+		snprintf(fn, sizeof(fn), "%d", i);
+		if ((mkdirat(dfd, fn, 0755) != 0)&&(errno != EEXIST)) perror_msg_and_die("mkdir");
+		snprintf(fn, sizeof(fn), "%d/comm", i);
+		int fd = openat(dfd, fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) perror_msg_and_die("open comm");
+		dprintf(fd, "%s\n", names[i % 8]);
+		close(fd);
+		snprintf(fn, sizeof(fn), "%d/cmdline", i);
+		fd = openat(dfd, fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) perror_msg_and_die("open cmdline");
+		if (write(fd, names[i % 8], strlen(names[i % 8]) + 1) < 0) perror_msg_and_die("write");
+		close(fd);
+		snprintf(fn, sizeof(fn), "%d/stat", i);
+		fd = openat(dfd, fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) perror_msg_and_die("open stat");
+		dprintf(fd, "%d (%s) %c 1 %d %d 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0\n",
+			i, names[i % 8], "SSRSDSSI"[i % 8], i, i);
+		close(fd);
+	}
+	return 0;
+}
+
+/* readdir dir name: the pidsearch of old (readdir, a path per pid, and
+ * a substring of comm), to compare the new one to. */
+static int bench_readdir(int argc, char **argv) {
+	if (argc < 3) error_msg_and_die("usage: readdir dir name");
+	DIR *d = opendir(argv[1]);
+	if (!d) perror_msg_and_die2("opendir", argv[1]);
+	char *nbuf = malloc(strlen(argv[1]) + 17);
+	if (!nbuf) perror_msg_and_die("malloc");
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		char *e, name[32];
+		errno = 0;
+		long int p = strtol(de->d_name, &e, 10);
+		if ((errno)||(*e)) continue;
+		sprintf(nbuf, "%s/%ld/comm", argv[1], p);
+		int fd = open(nbuf, O_RDONLY);
+		if (fd < 0) continue;
+		int l = read(fd, name, 31);
+		close(fd);
+		if (l <= 0) continue;
+		name[l] = 0;
+		if (strstr(name, argv[2])) printf("%ld ", p);
+	}
+	closedir(d);
+	return 0;
+}
+
+/* bgstamp us: leave a process behind that prints the time and exits
+ * after us microseconds, for "exit". */
+static int bench_bgstamp(int argc, char **argv) {
+	int us = argc > 1 ? atoi(argv[1]) : 10000;
+	pid_t p = fork();
+	if (p == -1) perror_msg_and_die("fork");
+	if (p) return 0;
+	usleep(us);
+	printf("%lld\n", (long long)monotime_ns());
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s run|exit|syscalls|procfs|readdir|bgstamp|true [args]\n", argv[0]);
+		exit(1);
+	}
+	char *c = argv[1];
+	argc--;
+	argv++;
+	if (strcmp(c, "true") == 0) return 0;
+	if (strcmp(c, "run") == 0) return bench_run(argc, argv);
+	if (strcmp(c, "exit") == 0) return bench_exit(argc, argv);
+	if (strcmp(c, "syscalls") == 0) return bench_syscalls(argc, argv);
+	if (strcmp(c, "procfs") == 0) return bench_procfs(argc, argv);
+	if (strcmp(c, "readdir") == 0) return bench_readdir(argc, argv);
+	if (strcmp(c, "bgstamp") == 0) return bench_bgstamp(argc, argv);
+	fprintf(stderr, "Unknown command %s\n", c);
+	return 1;
+}
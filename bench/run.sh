@@ -0,0 +1,79 @@
+#!/bin/sh
+# See LICENSE.
+#
+# Benchmarks for nschrooter and folks, run by "make bench" from the top
+# directory. Runs as an user (with user namespaces) or as root.
+# One line per result: name unit n p50 p90 p99 max
+# BENCH_N sets the number of runs, BENCH_JOBS the parallelism to go up to.
+
+N=${BENCH_N:-200}
+JOBS=${BENCH_JOBS:-8}
+TOP=$(pwd)
+B=$TOP/bench/bench
+NSC=$TOP/nschrooter
+
+W=$(mktemp -d "${TMPDIR:-/tmp}/nscbench.XXXXXX") || exit 1
+trap 'rm -rf "$W"' EXIT INT TERM
+
+# The tiny rootfs, just the static helper.
+R=$W/rootfs
+mkdir -p "$R/bin"
+cp "$B" "$R/bin/bench"
+
+printf '# %s, %s cpus, uid %s\n' "$(uname -sr)" "$(nproc)" "$(id -u)"
+printf '# name\tunit\tn\tp50\tp90\tp99\tmax\n'
+
+# Startup to exit for a new namespace.
+"$B" run -n "$N" cold "$NSC" -k -t 0 "$R" /bin/bench true
+"$B" run -n "$N" cold.overlay "$NSC" -O -t 0 "$R" /bin/bench true
+
+# Entry into a live one, by setns and by its fork server.
+"$NSC" -k -t -1 "$R" /bin/bench true
+"$B" run -n "$N" enter "$NSC" -E "$R" /bin/bench true
+"$B" run -n "$N" enter.srv "$NSC" -S "$R" /bin/bench true
+"$B" run -n "$N" enter.filter "$NSC" -F -E "$R" /bin/bench true
+"$NSC" -k -t 0 "$R" /bin/bench true 2>/dev/null
+
+# From the end of the last process to the end of the init.
+"$B" exit -n "$((N / 4 + 1))" "$R/.pid1" exit "$NSC" -k -t 0 "$R" /bin/bench bgstamp 20000
+
+# Containers per second.
+j=1
+while [ "$j" -le "$JOBS" ]; do
+	"$B" run -n "$N" -j "$j" "parallel.j$j" "$NSC" -O -t 0 "$R" /bin/bench true
+	j=$((j * 2))
+done
+
+# The per syscall cost of the filter.
+"$B" syscalls base
+if [ -x "$TOP/unsfilter" ]; then
+	export XDG_CACHE_HOME="$W/cache"
+	"$TOP/unsfilter" -O 1 "$B" syscalls unsfilter.linear
+	"$TOP/unsfilter" "$B" syscalls unsfilter
+	"$TOP/unsfilter" -D - "$B" syscalls unsfilter.fake
+	"$B" run -n "$N" unsfilter.start.nocache "$TOP/unsfilter" -N "$B" true
+	"$B" run -n "$N" unsfilter.start "$TOP/unsfilter" "$B" true
+else
+	echo "# unsfilter: not built, skipped"
+fi
+
+# Changing the apparent identity.
+if [ "$(id -u)" != 0 ]; then
+	"$B" run -n "$N" nssu.base "$B" true
+	"$B" run -n "$N" nssu "$TOP/nssu" -s "$B" root true
+	env -u XDG_CACHE_HOME HOME= "$B" run -n "$N" nssu.nocache "$TOP/nssu" -s "$B" root true
+	"$TOP/nssu" -D "$W/nssu.sock" &
+	sleep 1
+	NSSU_SOCK="$W/nssu.sock" "$B" run -n "$N" nssu.srv "$TOP/nssu" -s "$B" root true
+	kill $!
+else
+	echo "# nssu: cannot be used as root, skipped"
+fi
+
+# Scanning a large (synthetic) process list.
+"$B" procfs "$W/proc" 20000
+"$B" run -n "$((N / 10 + 1))" pidsearch.readdir "$B" readdir "$W/proc" sshd
+"$B" run -n "$((N / 10 + 1))" pidsearch "$TOP/pidsearch" "$W/proc" sshd
+"$B" run -n "$((N / 10 + 1))" pidsearch.j4 "$TOP/pidsearch" -j 4 "$W/proc" sshd
+"$B" run -n "$((N / 10 + 1))" pidsearch.full "$TOP/pidsearch" -j 4 -f -r '^(sshd|make)$' "$W/proc"
+"$B" run -n "$((N / 10 + 1))" pidsearch.state "$TOP/pidsearch" -j 4 -s D "$W/proc"
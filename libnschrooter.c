@@ -0,0 +1,2976 @@
+/* See LICENSE. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+#include <linux/openat2.h>
+#include <limits.h>
+#include <poll.h>
+#include "nsfilter.h"
+#include "nssrv.h"
+#include "libnschrooter.h"
+
+/* The new mount API (open_tree/move_mount/fsmount since 5.2, mount_setattr since 5.12).
+ * Done via syscall() with our own definitions, the libc headers are
+ * often older than the kernel (and disagree with <linux/mount.h>). */
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x04
+#endif
+#ifndef MOVE_MOUNT_T_EMPTY_PATH
+#define MOVE_MOUNT_T_EMPTY_PATH 0x40
+#endif
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen 430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig 431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount 432
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 1
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 1
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x1
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x1000
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+struct nsc_mount_attr {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+
+static void perror_msg_and_die2(const char* msg, const char *extra) {
+	if (extra) fprintf(stderr,"%s: ", extra);
+	perror(msg);
+	exit(1);
+}
+
+static void perror2(const char* msg, const char *extra) {
+	fprintf(stderr,"%s: ", extra);
+	perror(msg);
+}
+
+static void perror_msg_and_die(const char* msg) {
+	perror_msg_and_die2(msg, NULL);
+}
+
+static void error_msg_and_die(const char* msg) {
+	fprintf(stderr,"%s\n", msg);
+	exit(1);
+}
+
+static int64_t monotime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Startup tracing (-x fd): the time taken by each phase of the setup,
+ * and the syscalls (and of those, mounts) made and failed in it. Written
+ * as one line of JSON to trace_fd just before the program is run. */
+struct trace_phase {
+	const char *name;
+	int64_t start;
+	int64_t us;
+	int sys, mnt, fail;
+};
+
+#define TRACE_MAX 24
+static struct trace_phase trace[TRACE_MAX];
+static int trace_n = 0;
+static int trace_fd = -1;
+static const char *trace_mode = "new";
+
+/* Start the next phase, which ends the previous one. */
+static void trace_mark(const char *name) {
+	if ((trace_fd < 0)||(trace_n == TRACE_MAX)) return;
+	int64_t t = monotime_us();
+	if (trace_n) trace[trace_n-1].us = t - trace[trace_n-1].start;
+	trace[trace_n].name = name;
+	trace[trace_n].start = t;
+	trace_n++;
+}
+
+/* Count a syscall (returning r) in the current phase. */
+static long trace_sys(long r) {
+	if (trace_n) {
+		trace[trace_n-1].sys++;
+		if (r < 0) trace[trace_n-1].fail++;
+	}
+	return r;
+}
+
+static long trace_mnt(long r) {
+	if (trace_n) trace[trace_n-1].mnt++;
+	return trace_sys(r);
+}
+
+/* Stop tracing, in the processes that wont run the program. */
+static void trace_done(void) {
+	if (trace_fd > 2) close(trace_fd);
+	trace_fd = -1;
+}
+
+static void trace_dump(void) {
+	if ((trace_fd < 0)||(!trace_n)) return;
+	int64_t t = monotime_us();
+	trace[trace_n-1].us = t - trace[trace_n-1].start;
+	char buf[160 + TRACE_MAX * 96];
+	int l = snprintf(buf, sizeof(buf), "{\"pid\":%d,\"mode\":\"%s\",\"total_us\":%lld,\"phases\":[",
+		(int)getpid(), trace_mode, (long long)(t - trace[0].start));
+	for (int i=0;i<trace_n;i++) {
+		l += snprintf(buf+l, sizeof(buf)-l, "%s{\"name\":\"%s\",\"us\":%lld,\"syscalls\":%d,"
+			"\"mounts\":%d,\"failed\":%d}", i ? "," : "", trace[i].name,
+			(long long)trace[i].us, trace[i].sys, trace[i].mnt, trace[i].fail);
+	}
+	l += snprintf(buf+l, sizeof(buf)-l, "]}\n");
+	if (write(trace_fd, buf, l) != l) perror("trace");
+	trace_done();
+}
+
+static int pwritef(int dfd, const char * fn, const char *buf, int flags) {
+        int fd = openat(dfd, fn, O_WRONLY | flags, 0600);
+        if (fd < 0) return -1;
+        if (write(fd, buf, strlen(buf)) != strlen(buf))
+        	return -1;
+        close(fd);
+        return 0;
+}
+
+static void procwritef(const char * fn, const char *msg, ...) {
+	char buf[80];
+        va_list ap;
+        va_start(ap, msg);
+	if (vsnprintf(buf,80,msg,ap) >= 80) {
+		error_msg_and_die("procwritef buf overflow");
+	}
+        va_end(ap);
+        if (trace_sys(pwritef(AT_FDCWD, fn, buf, 0)) != 0) perror_msg_and_die2("procwritef", fn);
+}
+
+static void writelinef(int dfd, const char * fn, const char *msg, ...) {
+	char buf[80];
+        va_list ap;
+        va_start(ap, msg);
+	if (vsnprintf(buf,80,msg,ap) >= 80) {
+		error_msg_and_die("buf overflow");
+	}
+        va_end(ap);
+        if (pwritef(dfd, fn, buf, O_CREAT) != 0) perror_msg_and_die2("writelinef", fn);
+}
+
+/* Make new malloc() string c = a + b */
+static char* strdcat(const char *a, const char *b) {
+	size_t la = strlen(a);
+	char* c = malloc(la+strlen(b)+1);
+	if (!c) perror_msg_and_die("malloc");
+	memcpy(c,a,la);
+	strcpy(c+la,b);
+	return c;
+}
+
+static char *pfdreader(int fd, int *l) {
+	int ml = 1;
+	char *buf = NULL;
+	int o = 0;
+	do {
+		if ((ml-o-1) < 2048) {
+			ml += 4096;
+			buf = realloc(buf, ml);
+			if (!buf) perror_msg_and_die("(re)alloc");
+		}
+		int r = read(fd, buf+o, ml-o-1);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r<=0) break;
+		o += r;
+	} while (1);
+	buf[o] = 0;
+	if (l) *l = o;
+	return buf;
+}
+
+static int clean_env = 0;
+static int use_filter = 0; /* Ignore chown and set*id, like unsfilter */
+
+/* The cgroup (v2) of the instance (-L, -G): a leaf nschrooter-PID under
+ * the base cgroup, with the limits, and in it "init" for our init and
+ * "jobs" for everything else. So jobs/cgroup.events tells when the
+ * namespace is empty. */
+#define CG_PREFIX "nschrooter-"
+static int cg_dfd = -1;
+static int cg_base = -1;
+static int cg_home = -1; /* Where we were, to leave the instance's for. */
+static char cg_name[sizeof(CG_PREFIX) + 10];
+
+/* Where cgroup2 is mounted, NULL if nowhere. */
+static char *cg_mount(void) {
+	int fd = open("/proc/self/mounts", O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return NULL;
+	char *m = pfdreader(fd, NULL);
+	close(fd);
+	char *r = NULL;
+	for (char *l = m; (l)&&(*l); l = strchr(l, '\n') ? strchr(l, '\n') + 1 : NULL) {
+		char mp[256], type[16];
+		if ((sscanf(l, "%*s %255s %15s", mp, type) == 2)&&(strcmp(type, "cgroup2") == 0)) {
+			r = strdup(mp);
+			break;
+		}
+	}
+	free(m);
+	return r;
+}
+
+/* The cgroup of pid (0 = us), from its "0::" line. */
+static char *cg_of(int pid) {
+	char fn[6+10+7+1];
+	if (pid) sprintf(fn, "/proc/%d/cgroup", pid);
+	else strcpy(fn, "/proc/self/cgroup");
+	int fd = open(fn, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return NULL;
+	char *c = pfdreader(fd, NULL);
+	close(fd);
+	char *p = strstr(c, "0::/");
+	char *r = NULL;
+	if ((p)&&((p == c)||(p[-1] == '\n'))) r = strndup(p + 3, strcspn(p + 3, "\n"));
+	free(c);
+	return r;
+}
+
+/* Make the cgroup of the instance under base (NULL = the parent of our
+ * own cgroup as an user, as that is where we might have been delegated
+ * to, or /nschrooter as root), and apply the "file=value" limits. */
+static void cg_setup(const char *base, char **limits, int nlimits, int muid) {
+	char *bp = NULL;
+	if (!base) {
+		char *mnt = cg_mount();
+		if (!mnt) error_msg_and_die("No cgroup2 mounted");
+		char *self = muid ? cg_of(0) : strdup("/nschrooter");
+		if (!self) error_msg_and_die("Cannot find our cgroup");
+		char *sl = strrchr(self, '/');
+		if ((muid)&&(sl)) *sl = 0;
+		bp = strdcat(mnt, self);
+		free(mnt);
+		free(self);
+		base = bp;
+		if (!muid) (void) mkdir(base, 0755);
+	}
+	cg_base = open(base, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (cg_base < 0) perror_msg_and_die2("open", base);
+	char *mnt = cg_mount(), *self = cg_of(0), *home;
+	if ((mnt)&&(self)&&(asprintf(&home, "%s%s", mnt, self) >= 0)) {
+		cg_home = open(home, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		free(home);
+	}
+	free(mnt);
+	free(self);
+
+	/* Take out the ones left behind by inits that are gone. Those whose
+	 * maker is still there might be just being set up. */
+	int dfd = openat(cg_base, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+	struct dirent *de;
+	while ((d)&&(de = readdir(d))) {
+		if (strncmp(de->d_name, CG_PREFIX, strlen(CG_PREFIX)) != 0) continue;
+		int maker = atoi(de->d_name + strlen(CG_PREFIX));
+		if ((maker <= 0)||(kill(maker, 0) == 0)||(errno != ESRCH)) continue;
+		char fn[sizeof(de->d_name) + 5];
+		snprintf(fn, sizeof(fn), "%s/init", de->d_name);
+		(void) unlinkat(cg_base, fn, AT_REMOVEDIR);
+		snprintf(fn, sizeof(fn), "%s/jobs", de->d_name);
+		(void) unlinkat(cg_base, fn, AT_REMOVEDIR);
+		(void) unlinkat(cg_base, de->d_name, AT_REMOVEDIR);
+	}
+	if (d) closedir(d);
+
+	/* Enable the controllers of the limits for the leaves of base. */
+	for (int i=0;i<nlimits;i++) {
+		char ctl[32];
+		int l = strcspn(limits[i], ".=/");
+		if ((limits[i][l] != '.')||(l >= sizeof(ctl) - 1)) error_msg_and_die("Bad cgroup limit");
+		ctl[0] = '+';
+		memcpy(ctl + 1, limits[i], l);
+		ctl[l + 1] = 0;
+		if (trace_sys(pwritef(cg_base, "cgroup.subtree_control", ctl, 0)) != 0)
+			perror_msg_and_die2("cgroup.subtree_control", ctl);
+	}
+
+	snprintf(cg_name, sizeof(cg_name), CG_PREFIX "%d", (int)getpid());
+	if (trace_sys(mkdirat(cg_base, cg_name, 0755)) != 0) perror_msg_and_die2("mkdir", cg_name);
+	cg_dfd = openat(cg_base, cg_name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (cg_dfd < 0) perror_msg_and_die2("open", cg_name);
+	if ((trace_sys(mkdirat(cg_dfd, "init", 0755)) != 0)||(trace_sys(mkdirat(cg_dfd, "jobs", 0755)) != 0))
+		perror_msg_and_die("mkdir(cgroup)");
+	for (int i=0;i<nlimits;i++) {
+		char *v = strchr(limits[i], '=');
+		if (!v) error_msg_and_die("Bad cgroup limit");
+		*v = 0;
+		if (trace_sys(pwritef(cg_dfd, limits[i], v + 1, 0)) != 0) perror_msg_and_die2("cgroup", limits[i]);
+		*v = '=';
+	}
+	free(bp);
+}
+
+/* Move us into sub ("init" or "jobs") of the cgroup of the instance, if any. */
+static void cg_join(const char *sub) {
+	if (cg_dfd < 0) return;
+	char fn[5+1+12+1];
+	snprintf(fn, sizeof(fn), "%s/cgroup.procs", sub);
+	if (trace_sys(pwritef(cg_dfd, fn, "0", 0)) != 0) perror_msg_and_die2("cgroup", fn);
+}
+
+/* Remove the cgroup, once no one is in it. The init has to step out
+ * of it first, back to where it came from. */
+static void cg_cleanup(void) {
+	if (cg_dfd < 0) return;
+	if (cg_home >= 0) (void) pwritef(cg_home, "cgroup.procs", "0", 0);
+	(void) unlinkat(cg_dfd, "jobs", AT_REMOVEDIR);
+	(void) unlinkat(cg_dfd, "init", AT_REMOVEDIR);
+	(void) unlinkat(cg_base, cg_name, AT_REMOVEDIR);
+}
+
+/* Join the jobs of the namespace with pid as its init, if it has a cgroup.
+ * Otherwise the init would not know about us. */
+static void cg_enter(int pid) {
+	char *c = cg_of(pid);
+	if (!c) return;
+	int l = strlen(c);
+	if ((l > 5)&&(strcmp(c + l - 5, "/init") == 0)) {
+		c[l - 5] = 0;
+		char *sl = strrchr(c, '/');
+		char *mnt = NULL, *fn = NULL;
+		if ((sl)&&(strncmp(sl + 1, CG_PREFIX, strlen(CG_PREFIX)) == 0)) {
+			if ((!(mnt = cg_mount()))||(asprintf(&fn, "%s%s/jobs/cgroup.procs", mnt, c) < 0))
+				error_msg_and_die("Cannot find the cgroup of the namespace");
+			if (trace_sys(pwritef(AT_FDCWD, fn, "0", 0)) != 0) perror_msg_and_die2("cgroup", fn);
+		}
+		free(mnt);
+		free(fn);
+	}
+	free(c);
+}
+
+/* Is anyone in the jobs of the instance (from cgroup.events). */
+static int cg_populated(int fd) {
+	char buf[128];
+	int l = pread(fd, buf, sizeof(buf)-1, 0);
+	if (l <= 0) return 1;
+	buf[l] = 0;
+	char *p = strstr(buf, "populated ");
+	return p ? atoi(p + 10) : 1;
+}
+
+/* The environment for the program to run. */
+static char **prog_env(void) {
+	if (clean_env) {
+		/* We make a new environment just to be nice (and to add *sbin). */
+		static char * env[] = { "PATH=/bin:/sbin:/usr/bin:/usr/sbin", NULL, NULL };
+		char *termp = getenv("TERM");
+		if (termp) termp -= strlen("TERM=");
+		env[1] = termp;
+		return env;
+	}
+	return environ;
+}
+
+static void __attribute__((noreturn)) run_prog(char **argv) {
+	if ((use_filter)&&(nsfilter_apply() != 0))
+		perror_msg_and_die("seccomp filter");
+	trace_dump();
+	execvpe(argv[0], argv, prog_env());
+	perror("execvpe");
+	exit(127); /* Specific code for failure to run command. */
+}
+
+/* Generate a return value from a wait() status variable. */
+static uint8_t wait_retval(int status) {
+	if (WIFEXITED(status)) return WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) return WTERMSIG(status)+128;
+	/* Umm, well it likely wasnt succesful... arbitrary pick. */
+	return 255;
+}
+
+/* The usage report (-R): one line of JSON written when the program
+ * exits, with the rusage of the program itself, and of all the processes
+ * reaped in the namespace until then (by the init, or the program as
+ * init). The init sends them with the exit status. */
+static int report_fd = -1;
+static int64_t report_start;
+
+struct report_msg {
+	uint8_t retval;
+	struct rusage prog, all;
+};
+
+static void ru_add(struct rusage *a, const struct rusage *b) {
+	timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+	timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+	if (b->ru_maxrss > a->ru_maxrss) a->ru_maxrss = b->ru_maxrss;
+	a->ru_minflt += b->ru_minflt;
+	a->ru_majflt += b->ru_majflt;
+	a->ru_nvcsw += b->ru_nvcsw;
+	a->ru_nivcsw += b->ru_nivcsw;
+	a->ru_inblock += b->ru_inblock;
+	a->ru_oublock += b->ru_oublock;
+}
+
+static int ru_json(char *buf, int len, const char *name, const struct rusage *r) {
+	return snprintf(buf, len, "\"%s\":{\"user_us\":%lld,\"sys_us\":%lld,\"maxrss_kb\":%ld,"
+		"\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"inblock\":%ld,\"oublock\":%ld}",
+		name, r->ru_utime.tv_sec * 1000000LL + r->ru_utime.tv_usec,
+		r->ru_stime.tv_sec * 1000000LL + r->ru_stime.tv_usec, r->ru_maxrss,
+		r->ru_minflt, r->ru_majflt, r->ru_nvcsw, r->ru_nivcsw, r->ru_inblock, r->ru_oublock);
+}
+
+static void report_write(const struct report_msg *m) {
+	if (report_fd < 0) return;
+	char buf[768];
+	int l = snprintf(buf, sizeof(buf), "{\"pid\":%d,\"status\":%d,\"wall_us\":%lld,",
+		(int)getpid(), m->retval, (long long)(monotime_us() - report_start));
+	l += ru_json(buf+l, sizeof(buf)-l, "program", &m->prog);
+	buf[l++] = ',';
+	l += ru_json(buf+l, sizeof(buf)-l, "all", &m->all);
+	l += snprintf(buf+l, sizeof(buf)-l, "}\n");
+	if (write(report_fd, buf, l) != l) perror("report");
+}
+
+/* Wait for pid, and report on it if asked to. Returns the exit status. */
+static uint8_t wait_report(pid_t pid) {
+	struct report_msg m = { 0 };
+	int s;
+	while ((wait4(pid, &s, 0, &m.prog) < 0)&&(errno == EINTR));
+	m.retval = wait_retval(s);
+	m.all = m.prog;
+	report_write(&m);
+	return m.retval;
+}
+
+/* Copy file data in the kernel. */
+static int copy_data(int sfd, int dfd, off_t off, off_t len) {
+	while (len > 0) {
+		ssize_t r = sendfile(dfd, sfd, &off, len > (1<<30) ? (1<<30) : len);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r <= 0) return -1;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Output capture (-C prefix[:size[:keep]]): the stdout and stderr of the
+ * program go through pipes into prefix.out and prefix.err, rotated at
+ * size with keep old ones (prefix.out.1 ...), and on to ours with -V.
+ * The data is moved with splice, and for -V sendfile from the log, so
+ * it never goes through userspace. The parent does the pumping. The
+ * logs are opened (and rotated) relative to the directory of prefix,
+ * since the parent ends up in the new root (or namespace). */
+static char *cap_prefix = NULL;
+static int cap_dfd = -1;
+static off_t cap_size = 16 << 20;
+static int cap_keep = 2;
+static int cap_live = 0;
+static int cap_pipes[2] = { -1, -1 }; /* The write ends */
+
+struct cap_log {
+	int in, out, fd;
+	off_t size;
+	const char *sfx;
+};
+static struct cap_log cap_logs[2] = {
+	{ .in = -1, .out = 1, .fd = -1, .sfx = "out" },
+	{ .in = -1, .out = 2, .fd = -1, .sfx = "err" },
+};
+
+static void cap_option(char *spec) {
+	char *c = strchr(spec, ':');
+	cap_prefix = spec;
+	if (!c) return;
+	*c++ = 0;
+	char *e;
+	cap_size = strtoll(c, &e, 10);
+	switch (*e) {
+		case 'G': case 'g': cap_size <<= 10; /* fallthrough */
+		case 'M': case 'm': cap_size <<= 10; /* fallthrough */
+		case 'K': case 'k': cap_size <<= 10; e++; break;
+	}
+	if (*e == ':') cap_keep = atoi(e+1);
+	else if (*e) error_msg_and_die("-C prefix[:size[:keep]]");
+	if ((cap_size <= 0)||(cap_keep < 0)) error_msg_and_die("-C prefix[:size[:keep]]");
+}
+
+static void cap_open(struct cap_log *l, int trunc) {
+	char fn[NAME_MAX+1];
+	snprintf(fn, sizeof(fn), "%s.%s", cap_prefix, l->sfx);
+	/* Not O_APPEND, splice does not do that. */
+	l->fd = openat(cap_dfd, fn, O_RDWR|O_CREAT|O_CLOEXEC|(trunc ? O_TRUNC : 0), 0644);
+	if (l->fd < 0) perror_msg_and_die2("open", fn);
+	l->size = lseek(l->fd, 0, SEEK_END);
+}
+
+static void cap_rotate(struct cap_log *l) {
+	char a[NAME_MAX+1], b[NAME_MAX+1];
+	close(l->fd);
+	for (int i=cap_keep;i>0;i--) {
+		if (i > 1) snprintf(a, sizeof(a), "%s.%s.%d", cap_prefix, l->sfx, i-1);
+		else snprintf(a, sizeof(a), "%s.%s", cap_prefix, l->sfx);
+		snprintf(b, sizeof(b), "%s.%s.%d", cap_prefix, l->sfx, i);
+		(void) renameat(cap_dfd, a, cap_dfd, b);
+	}
+	cap_open(l, 1);
+}
+
+/* Early, while prefix still means what it should. */
+static void cap_setup(void) {
+	if (!cap_prefix) return;
+	char *s = strrchr(cap_prefix, '/');
+	if (s) {
+		*s = 0;
+		cap_dfd = open(s == cap_prefix ? "/" : cap_prefix, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (cap_dfd < 0) perror_msg_and_die2("open", cap_prefix);
+		cap_prefix = s+1;
+	} else {
+		cap_dfd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (cap_dfd < 0) perror_msg_and_die("open(.)");
+	}
+	for (int i=0;i<2;i++) {
+		int p[2];
+		if (pipe2(p, O_CLOEXEC) != 0) perror_msg_and_die("pipe");
+		cap_logs[i].in = p[0];
+		cap_pipes[i] = p[1];
+		cap_open(&cap_logs[i], 0);
+	}
+}
+
+/* In the child, after the fork. */
+static void cap_child(void) {
+	if (!cap_prefix) return;
+	for (int i=0;i<2;i++) {
+		close(cap_logs[i].in);
+		close(cap_logs[i].fd);
+	}
+}
+
+/* The pipes become the stdout and stderr of the program (prog), or just
+ * go (an init, that does not write to them, and must not keep them open). */
+static void cap_stdio(int prog) {
+	if (!cap_prefix) return;
+	for (int i=0;i<2;i++) {
+		if ((prog)&&(dup2(cap_pipes[i], 1+i) < 0)) perror_msg_and_die("dup2");
+		close(cap_pipes[i]);
+	}
+}
+
+static ssize_t cap_move(struct cap_log *l, int flags) {
+	if (l->size >= cap_size) cap_rotate(l);
+	off_t at = l->size;
+	ssize_t r = splice(l->in, NULL, l->fd, NULL, cap_size - l->size, SPLICE_F_MOVE|flags);
+	if (r > 0) {
+		l->size += r;
+		if (cap_live) (void) copy_data(l->fd, l->out, at, r);
+	}
+	return r;
+}
+
+/* Move the output to the logs until done is readable (the exit status,
+ * or a pidfd), or to the end of it without one. Whatever is left in the
+ * pipes then is taken too, but not waited for: we are done with the
+ * program, so the background processes it left get EPIPE (or SIGPIPE)
+ * for what they write after that, like with any closed pipe. */
+static void cap_run(int done) {
+	if (!cap_prefix) return;
+	struct cap_log *l = cap_logs;
+	int open = 2;
+	for (int i=0;i<2;i++) close(cap_pipes[i]);
+	while (open) {
+		struct pollfd p[3] = {
+			{ .fd = l[0].in, .events = POLLIN },
+			{ .fd = l[1].in, .events = POLLIN },
+			{ .fd = done, .events = POLLIN },
+		};
+		if (poll(p, 3, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror_msg_and_die("poll");
+		}
+		for (int i=0;i<2;i++) {
+			if (!p[i].revents) continue;
+			ssize_t r = cap_move(&l[i], 0);
+			if ((r == 0)||((r < 0)&&(errno != EINTR)&&(errno != EAGAIN))) {
+				if (r < 0) perror("splice");
+				close(l[i].in);
+				l[i].in = -1;
+				open--;
+			}
+		}
+		if (p[2].revents) break;
+	}
+	for (int i=0;i<2;i++) {
+		while ((l[i].in >= 0)&&(cap_move(&l[i], SPLICE_F_NONBLOCK) > 0));
+		if (l[i].in >= 0) close(l[i].in);
+		close(l[i].fd);
+	}
+}
+
+/* Batch mode: commands are read from batch_fd, one per line. */
+static int batch_fd = -1;
+static int batch_jobs = 1;
+
+struct batch_job {
+	pid_t pid;
+	int idx;
+	int64_t start;
+	char *cmd;
+};
+
+/* Run the commands from batch_fd with sh -c, batch_jobs at a time, and
+ * report the exit status and wall time of each on stderr as they finish.
+ * Returns the status of the first command that failed, or 0. */
+static int batch_run(void) {
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+	int sfd = signalfd(-1, &chld, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) perror_msg_and_die("signalfd");
+	if (batch_jobs < 1) batch_jobs = 1;
+	struct batch_job *bj = calloc(batch_jobs, sizeof(*bj));
+	if (!bj) perror_msg_and_die("calloc");
+
+	char *buf = NULL;
+	int bl = 0, bo = 0; /* size and fill of buf */
+	int eof = 0, running = 0, idx = 0, retval = 0;
+	while ((!eof)||(running)||(bo)) {
+		/* Start what we have lines and slots for. */
+		while (running < batch_jobs) {
+			char *nl = memchr(buf, '\n', bo);
+			if ((!nl)&&(!(eof && bo))) break;
+			int ll = nl ? nl - buf : bo;
+			char *cmd = strndup(buf, ll);
+			if (!cmd) perror_msg_and_die("strndup");
+			bo -= nl ? ll + 1 : ll;
+			memmove(buf, buf + (nl ? ll + 1 : ll), bo);
+			char *c = cmd + strspn(cmd, " \t");
+			if ((!*c)||(*c == '#')) {
+				free(cmd);
+				continue;
+			}
+			int j = 0;
+			while (bj[j].pid) j++;
+			bj[j].idx = ++idx;
+			bj[j].cmd = cmd;
+			bj[j].start = monotime_us();
+			bj[j].pid = fork();
+			if (bj[j].pid == -1) perror_msg_and_die("fork");
+			if (!bj[j].pid) {
+				sigprocmask(SIG_UNBLOCK, &chld, NULL);
+				close(batch_fd);
+				if (!batch_fd) {
+					/* Dont let them eat the commands. With 0 just closed,
+					 * that is where it normally lands already. */
+					int nfd = open("/dev/null", O_RDONLY);
+					if ((nfd >= 0)&&(nfd != 0)) dup2(nfd, 0);
+					if (nfd > 2) close(nfd);
+				}
+				char *sh[] = { "/bin/sh", "-c", cmd, NULL };
+				run_prog(sh);
+			}
+			running++;
+		}
+
+		struct pollfd pfd[2] = {
+			{ .fd = sfd, .events = POLLIN },
+			{ .fd = batch_fd, .events = POLLIN }
+		};
+		/* Only read more when there is a slot for it. */
+		int more = (!eof)&&(running < batch_jobs);
+		if (poll(pfd, more ? 2 : 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror_msg_and_die("poll");
+		}
+		if ((more)&&(pfd[1].revents)) {
+			if ((bl-bo) < 2048) {
+				bl += 4096;
+				buf = realloc(buf, bl);
+				if (!buf) perror_msg_and_die("(re)alloc");
+			}
+			int r = read(batch_fd, buf+bo, bl-bo);
+			if ((r==-1)&&((errno==EINTR)||(errno==EAGAIN))) continue;
+			if (r <= 0) eof = 1;
+			else bo += r;
+		}
+		if (pfd[0].revents) {
+			struct signalfd_siginfo si;
+			while (read(sfd, &si, sizeof(si)) == sizeof(si));
+			int st;
+			pid_t r;
+			while ((r = waitpid(-1, &st, WNOHANG)) > 0) {
+				for (int j=0;j<batch_jobs;j++) {
+					if (bj[j].pid != r) continue;
+					int64_t t = monotime_us() - bj[j].start;
+					uint8_t rv = wait_retval(st);
+					fprintf(stderr, "#%d\t%d\t%lld.%06lld\t%s\n", bj[j].idx, rv,
+						(long long)(t / 1000000), (long long)(t % 1000000), bj[j].cmd);
+					if ((rv)&&(!retval)) retval = rv;
+					free(bj[j].cmd);
+					bj[j].pid = 0;
+					running--;
+					break;
+				}
+			}
+		}
+	}
+	return retval;
+}
+
+static void ns_enter(int pid, int pidfd, char **argv) {
+	/* Enter the namespaces identified by the pid (or pidfd, if we have one)
+	 * and run the program specified in argv. */
+	const char * spaces[] = {
+		"/proc/%d/ns/user",
+		"/proc/%d/ns/uts",
+		"/proc/%d/ns/pid",
+		"/proc/%d/ns/mnt"
+	};
+	char buf[6+10+4+4+1];
+	int s = 1;
+	/* If we're non-root, enter the user namespace first. */
+	if (getuid()) s = 0;
+
+	/* Since 5.8 all of them can be entered at once, atomically, by pidfd. */
+	int all = CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNS | (s ? 0 : CLONE_NEWUSER);
+	trace_mode = "enter";
+	trace_mark("cgroup");
+	cg_enter(pid);
+	trace_mark("setns");
+	if ((pidfd < 0)||(trace_sys(setns(pidfd, all)) != 0)) {
+		if ((pidfd >= 0)&&(errno != EINVAL))
+			perror_msg_and_die("setns(pidfd)");
+		for (;s<4;s++) {
+			sprintf(buf,spaces[s],pid);
+			int fd = open(buf, O_RDONLY);
+			if (trace_sys(setns(fd, 0)) != 0)
+				perror_msg_and_die2("setns", buf);
+			close(fd);
+		}
+	}
+	if (pidfd >= 0) close(pidfd);
+
+	if (chdir("/") != 0)
+		perror_msg_and_die("chdir(/)");
+
+	/* To enter the pid namespace, do a fork(). */
+	trace_mark("fork");
+	int chld = trace_sys(fork());
+	if (chld == -1) perror_msg_and_die("fork");
+	if (chld) {
+		trace_done();
+		cap_run(syscall(SYS_pidfd_open, chld, 0));
+		/* Wait for the child.. */
+		exit(wait_report(chld));
+	}
+	cap_child();
+	cap_stdio(1);
+
+	/* Here we gooooo... */
+	if (batch_fd >= 0) {
+		trace_dump();
+		exit(batch_run());
+	}
+	run_prog(argv);
+}
+
+static int proc_list_pids(DIR **proc) {
+	if (!(*proc)) {
+		*proc = opendir("/proc");
+	}
+	if (!(*proc)) return 0;
+	struct dirent *d;
+	while ((d = readdir(*proc))) {
+		char *e;
+		errno = 0;
+		long int pid = strtol(d->d_name,&e,10);
+		if (errno) continue;
+		if (*e != 0) continue;
+		return pid;
+	}
+	closedir(*proc);
+	*proc = NULL;
+	return 0;
+}
+
+#define PID1_FN ".pid1"
+#define SOCK_FN ".pid1.sock"
+#define POOL_FN ".pool.sock"
+#define INFO_FN ".info"
+
+/* The pid file of the namespace, NULL for anonymous ones. It and the
+ * sockets live in the state directory (the rootfs, unless overlaid). */
+static const char *pid1_fn = PID1_FN;
+static int state_dfd = AT_FDCWD;
+
+/* Named instances (-n) have a state directory of their own under the
+ * runtime directory, with an INFO_FN (start time, root, command line). */
+static const char *state_name = NULL;
+static int state_base = -1;
+
+static int state_base_open(int muid) {
+	char fn[PATH_MAX];
+	char *rd = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+	if ((rd)&&(*rd)) snprintf(fn, sizeof(fn), "%s/nschrooter", rd);
+	else if (!muid) strcpy(fn, "/run/nschrooter");
+	else snprintf(fn, sizeof(fn), "/tmp/nschrooter-%d", muid);
+	if ((mkdir(fn, 0700) != 0)&&(errno != EEXIST)) perror_msg_and_die2("mkdir", fn);
+	int fd = open(fn, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if ((fd < 0)||(fstat(fd, &st) != 0)) perror_msg_and_die2("open", fn);
+	if (st.st_uid != muid) error_msg_and_die("The instance directory is not ours");
+	return fd;
+}
+
+/* The instance is gone, remove its state. */
+static void state_drop(int dfd, int lfd) {
+	if (pid1_fn) unlinkat(dfd, pid1_fn, 0);
+	if (lfd >= 0) unlinkat(dfd, SOCK_FN, 0);
+	if (state_name) {
+		unlinkat(dfd, INFO_FN, 0);
+		unlinkat(state_base, state_name, AT_REMOVEDIR);
+	}
+}
+
+/* Path to fn in the state directory, for the sockets. */
+static const char *state_path(const char *fn) {
+	static char buf[14+10+1+16];
+	if (state_dfd == AT_FDCWD) return fn;
+	snprintf(buf, sizeof(buf), "/proc/self/fd/%d/%s", state_dfd, fn);
+	return buf;
+}
+
+/* The fork server: the init listens on SOCK_FN next to PID1_FN (see
+ * nssrv.h), and a request is this header, the stdin/out/err fds of the
+ * client, and then argv and envp. The exit status comes back as one byte
+ * (or a struct report_msg). A request without an argv asks for a pidfd of the init instead, which
+ * comes back with a single byte: the socket is the pidfd holder of the
+ * instance, only the live init can be listening on it. */
+struct srv_req {
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t filter; /* use_filter */
+	uint32_t report; /* Send back a struct report_msg instead of the byte */
+};
+
+/* Have the init at the other end of fd run the program for us. Doesnt
+ * return if it did, returns (and closes fd) if that cant be done. */
+static void srv_run(int fd, char **argv) {
+	if (fd < 0) return;
+	char **envp = prog_env();
+	struct srv_req h = { 0, 0, use_filter, report_fd >= 0 };
+	while (argv[h.argc]) h.argc++;
+	while (envp[h.envc]) h.envc++;
+	char **strs[2] = { argv, envp };
+	int fds[3] = { 0, 1, 2 };
+	if (trace_sys(srv_send(fd, &h, sizeof(h), strs, 2, fds, 3)) != 0) {
+		close(fd);
+		return;
+	}
+	trace_dump();
+	srv_forward(fd);
+
+	struct report_msg m;
+	int r;
+	do {
+		r = recv(fd, &m, sizeof(m), 0);
+	} while ((r==-1)&&(errno==EINTR));
+	if ((r != 1)&&(r != sizeof(m))) error_msg_and_die("Lost the fork server");
+	if (r == sizeof(m)) report_write(&m);
+	exit(m.retval);
+}
+
+struct srv_job {
+	pid_t pid;
+	int conn;
+	int report;
+};
+
+static struct srv_job *jobs = NULL;
+static int njobs = 0;
+
+static int pid1_check(int pidfd, int pid, unsigned long long start, const char *root);
+
+/* Ask the init listening in the state directory dfd for its pidfd.
+ * Returns it, and its pid (as we see it) in *pid, or -1. Anyone in the
+ * instance could be listening there, so the server must be us (or root),
+ * and what it gives has to pass the checks of pid1_open() (against the
+ * start time in PID1_FN, and root if not NULL). */
+static int srv_pidfd(int dfd, int *pid, const char *root) {
+	char fn[14+10+1+16];
+	if (dfd == AT_FDCWD) strcpy(fn, SOCK_FN);
+	else snprintf(fn, sizeof(fn), "/proc/self/fd/%d/%s", dfd, SOCK_FN);
+	int fd = sock_connect(fn);
+	if (fd < 0) return -1;
+	struct ucred uc;
+	socklen_t ul = sizeof(uc);
+	if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &ul) != 0)||((uc.uid != getuid())&&(uc.uid != 0))) {
+		close(fd);
+		return -1;
+	}
+	struct timeval tv = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	struct srv_req h = { 0, 0, 0, 0 };
+	char b;
+	int pidfd = -1;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &b, .iov_len = 1 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	if ((srv_send(fd, &h, sizeof(h), NULL, 0, NULL, 0) == 0)&&(recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) == 1)) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if ((cm)&&(cm->cmsg_type == SCM_RIGHTS))
+			memcpy(&pidfd, CMSG_DATA(cm), sizeof(int));
+	}
+	close(fd);
+	if (pidfd < 0) return -1;
+
+	/* The pid, from its fdinfo (-1 if it has exited since). */
+	char ifn[6+4+8+10+1];
+	sprintf(ifn, "/proc/self/fdinfo/%d", pidfd);
+	fd = open(ifn, O_RDONLY|O_CLOEXEC);
+	char *info = fd >= 0 ? pfdreader(fd, NULL) : NULL;
+	if (fd >= 0) close(fd);
+	char *p = info ? strstr(info, "Pid:") : NULL;
+	*pid = p ? atoi(p + 4) : 0;
+	free(info);
+
+	unsigned long long start = 0;
+	int p1 = 0;
+	fd = openat(dfd, PID1_FN, O_RDONLY|O_CLOEXEC);
+	info = fd >= 0 ? pfdreader(fd, NULL) : NULL;
+	if (fd >= 0) close(fd);
+	if (info) sscanf(info, "%d %llu", &p1, &start);
+	free(info);
+	if ((*pid <= 0)||((p1)&&(p1 != *pid))||(pid1_check(pidfd, *pid, start, root) != 0)) {
+		close(pidfd);
+		return -1;
+	}
+	return pidfd;
+}
+
+/* Send our pidfd to the client on conn. */
+static void srv_give_pidfd(int conn) {
+	static int self = -1;
+	if (self < 0) self = syscall(SYS_pidfd_open, getpid(), 0);
+	if (self < 0) return;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = "P", .iov_len = 1 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &self, sizeof(int));
+	(void) sendmsg(conn, &mh, MSG_NOSIGNAL);
+}
+
+/* Read a request from conn and fork off the program for it. */
+static pid_t srv_spawn(int conn, int *report) {
+	int fds[3] = { -1, -1, -1 };
+	char *buf = NULL;
+	pid_t pid = -1;
+	ssize_t len = srv_recv(conn, sizeof(struct srv_req), fds, 3, &buf);
+	if (len < 0) goto out;
+
+	struct srv_req h;
+	memcpy(&h, buf, sizeof(h));
+	if (!h.argc) {
+		srv_give_pidfd(conn);
+		goto out;
+	}
+	*report = h.report;
+	uint32_t counts[2] = { h.argc, h.envc };
+	char **v = srv_split(buf, len, sizeof(h), counts, 2);
+	if (!v) goto out;
+
+	pid = fork();
+	if (pid == 0) {
+		sigset_t chld;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &chld, NULL);
+		cg_join("jobs");
+		for (int i=0;i<3;i++)
+			if ((fds[i] >= 0)&&(dup2(fds[i], i) != i)) _exit(127);
+		environ = v + h.argc + 1;
+		clean_env = 0;
+		use_filter = h.filter;
+		run_prog(v);
+	}
+	free(v);
+out:
+	for (int i=0;i<3;i++) if (fds[i] >= 0) close(fds[i]);
+	free(buf);
+	return pid;
+}
+
+/* Our own epoll events, next to those of nssrv.h. */
+#define EV_JOINER (4ULL << 32)
+#define EV_CGROUP (5ULL << 32)
+#define EV_CLIENT (6ULL << 32)
+
+/* The joiners we have a pidfd (in the epoll set) for. */
+struct joiner {
+	pid_t pid;
+	int pfd;
+};
+static struct joiner *joined = NULL;
+static int njoined = 0;
+
+/* Find processes that joined the namespace (-E) and are not our children,
+ * and add a pidfd for each of them to ep, to be told when they exit.
+ * Those we have already are skipped, as this is also the rescan of the
+ * poll fallback. Returns the number tracked, or -1 if some cant be waited
+ * for (no pidfd). */
+static int track_joiners(int ep) {
+	DIR *d = NULL;
+	int p, n = 0;
+	while((p = proc_list_pids(&d))) {
+		if (p<=1) continue;
+		int i;
+		for (i=0;i<njoined;i++) if (joined[i].pid == p) break;
+		if (i < njoined) continue;
+		int pfd = syscall(SYS_pidfd_open, p, 0); /* Always close-on-exec */
+		if (pfd < 0) {
+			if (errno == ESRCH) continue; /* Gone already. */
+			n = -1;
+			continue;
+		}
+		joined = realloc(joined, (njoined + 1) * sizeof(*joined));
+		if (!joined) perror_msg_and_die("(re)alloc");
+		joined[njoined].pid = p;
+		joined[njoined].pfd = pfd;
+		njoined++;
+		ep_add(ep, pfd, EV_JOINER);
+	}
+	return n < 0 ? -1 : njoined;
+}
+
+/* A joiner has exited. */
+static void joiner_gone(int ep, int pfd) {
+	ep_close(ep, pfd);
+	for (int i=0;i<njoined;i++) {
+		if (joined[i].pfd != pfd) continue;
+		joined[i] = joined[--njoined];
+		break;
+	}
+}
+
+/* The pool of namespaces (-P): each instance is an init, set up as usual,
+ * and connected to the manager with a socketpair. When one is claimed
+ * (-p), the manager passes its end of that to the client, which then
+ * talks to the instance like to a fork server, and a new instance is
+ * started to take its place. An instance runs one program and quits. */
+struct pool_inst {
+	pid_t pid;
+	int conn;
+	int ready;
+	int64_t start;
+};
+
+static void pool_stats(void) {
+	int fd = sock_connect(state_path(POOL_FN));
+	if (fd < 0) perror_msg_and_die("connect(" POOL_FN ")");
+	char buf[256];
+	int r = -1;
+	if (send(fd, "S", 1, MSG_NOSIGNAL) == 1) r = recv(fd, buf, sizeof(buf)-1, 0);
+	if (r <= 0) error_msg_and_die("No stats from the pool");
+	buf[r] = 0;
+	printf("%s\n", buf);
+	exit(0);
+}
+
+/* Claim a namespace from the pool and run argv in it. Returns on a miss. */
+static void pool_run(char **argv) {
+	trace_mode = "pool";
+	int fd = sock_connect(state_path(POOL_FN));
+	if (fd < 0) return;
+	char ans;
+	int cfd = -1;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &ans, .iov_len = 1 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	if ((send(fd, "C", 1, MSG_NOSIGNAL) == 1)&&(recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) == 1)) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if ((cm)&&(cm->cmsg_type == SCM_RIGHTS))
+			memcpy(&cfd, CMSG_DATA(cm), sizeof(int));
+	}
+	close(fd);
+	srv_run(cfd, argv);
+}
+
+/* The fds of the manager, that an instance has no business with. */
+struct fdset {
+	int *fd;
+	int n;
+};
+
+static void fdset_add(struct fdset *f, int fd) {
+	f->fd = realloc(f->fd, (f->n + 1) * sizeof(int));
+	if (!f->fd) perror_msg_and_die("(re)alloc");
+	f->fd[f->n++] = fd;
+}
+
+static void fdset_del(struct fdset *f, int fd) {
+	for (int i=0;i<f->n;i++) {
+		if (f->fd[i] != fd) continue;
+		f->fd[i] = f->fd[--f->n];
+		break;
+	}
+}
+
+/* Start a pool instance. Returns the fd for it in the child, -1 in the
+ * manager (where it is added to mfds). */
+static int pool_spawn(struct pool_inst *pi, struct fdset *mfds) {
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sp) != 0)
+		perror_msg_and_die("socketpair");
+	pi->start = monotime_us();
+	pi->ready = 0;
+	pi->pid = fork();
+	if (pi->pid == -1) perror_msg_and_die("fork");
+	if (!pi->pid) {
+		/* Including the conns of the other instances, or they would
+		 * never see their claimer go away. */
+		for (int i=0;i<mfds->n;i++) close(mfds->fd[i]);
+		close(sp[0]);
+		sigset_t chld;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigaddset(&chld, SIGTERM);
+		sigaddset(&chld, SIGINT);
+		sigaddset(&chld, SIGUSR1);
+		sigprocmask(SIG_UNBLOCK, &chld, NULL);
+		return sp[1];
+	}
+	close(sp[1]);
+	pi->conn = sp[0];
+	fdset_add(mfds, pi->conn);
+	return -1;
+}
+
+/* The instance is gone (or claimed), and so is our conn to it. */
+static void pool_drop(struct pool_inst *pi, struct fdset *mfds, int ep) {
+	fdset_del(mfds, pi->conn);
+	ep_close(ep, pi->conn);
+}
+
+/* Run the pool of n instances. Returns only in the instances. */
+static int pool_manager(int n) {
+	int lfd = srv_listen(state_path(POOL_FN));
+	if (lfd < 0) perror_msg_and_die("listen(" POOL_FN ")");
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	int sfd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) perror_msg_and_die("signalfd");
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) perror_msg_and_die("epoll_create1");
+	ep_add(ep, sfd, EV_SIG);
+	ep_add(ep, lfd, EV_LISTEN);
+	struct fdset mfds = { NULL, 0 };
+	fdset_add(&mfds, lfd);
+	fdset_add(&mfds, sfd);
+	fdset_add(&mfds, ep);
+
+	struct pool_inst *pi = calloc(n, sizeof(*pi));
+	if (!pi) perror_msg_and_die("calloc");
+	unsigned long hits = 0, misses = 0, refills = 0;
+	int64_t refill_sum = 0, refill_last = 0, refill_max = 0;
+	int fails = 0;
+	for (int i=0;i<n;i++) {
+		int c = pool_spawn(&pi[i], &mfds);
+		if (c >= 0) return c;
+		ep_add(ep, pi[i].conn, EV_CONN);
+	}
+
+	do {
+		struct epoll_event evs[16];
+		int ne = epoll_wait(ep, evs, 16, -1);
+		for (int e=0;e<ne;e++) {
+			int fd = (uint32_t)evs[e].data.u64;
+			uint64_t type = evs[e].data.u64 & ~0xFFFFFFFFULL;
+			if (type == EV_SIG) {
+				struct signalfd_siginfo si;
+				while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+					if ((si.ssi_signo == SIGTERM)||(si.ssi_signo == SIGINT)) {
+						/* The instances go away as their connection does. */
+						unlinkat(state_dfd, POOL_FN, 0);
+						exit(0);
+					}
+				}
+				int st;
+				pid_t r;
+				while ((r = waitpid(-1, &st, WNOHANG)) > 0) {
+					for (int i=0;i<n;i++) {
+						if (pi[i].pid != r) continue;
+						/* An instance died before it got to be used. */
+						if (++fails > 3) error_msg_and_die("Pool instances keep failing");
+						pool_drop(&pi[i], &mfds, ep);
+						int c = pool_spawn(&pi[i], &mfds);
+						if (c >= 0) return c;
+						ep_add(ep, pi[i].conn, EV_CONN);
+					}
+				}
+			} else if (type == EV_CONN) {
+				/* Instance ready (or dead, which SIGCHLD takes care of). */
+				char b;
+				if (recv(fd, &b, 1, MSG_DONTWAIT) != 1) continue;
+				for (int i=0;i<n;i++) {
+					if (pi[i].conn != fd) continue;
+					epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+					pi[i].ready = 1;
+					fails = 0;
+					refill_last = monotime_us() - pi[i].start;
+					refill_sum += refill_last;
+					if (refill_last > refill_max) refill_max = refill_last;
+					refills++;
+				}
+			} else if (type == EV_LISTEN) {
+				int c;
+				while ((c = accept4(lfd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) >= 0) {
+					struct ucred uc;
+					socklen_t ul = sizeof(uc);
+					if ((getsockopt(c, SOL_SOCKET, SO_PEERCRED, &uc, &ul) != 0)||(uc.uid != getuid())) {
+						close(c);
+						continue;
+					}
+					/* The request comes when it comes, dont wait for it here. */
+					ep_add(ep, c, EV_CLIENT);
+					fdset_add(&mfds, c);
+				}
+			} else if (type == EV_CLIENT) {
+				int c = fd;
+				char req = 0;
+				int x = recv(c, &req, 1, 0);
+				if ((x == -1)&&(errno == EAGAIN)) continue;
+				fdset_del(&mfds, c);
+				epoll_ctl(ep, EPOLL_CTL_DEL, c, NULL);
+				if (x != 1) {
+					close(c);
+					continue;
+				}
+				if (req == 'S') {
+					char buf[256];
+					int idle = 0;
+					for (int i=0;i<n;i++) idle += pi[i].ready;
+					snprintf(buf, sizeof(buf), "size %d idle %d hits %lu misses %lu refills %lu"
+						" refill_last_us %lld refill_avg_us %lld refill_max_us %lld",
+						n, idle, hits, misses, refills, (long long)refill_last,
+						(long long)(refills ? refill_sum / refills : 0), (long long)refill_max);
+					(void) send(c, buf, strlen(buf), MSG_NOSIGNAL);
+				} else if (req == 'C') {
+					int i;
+					for (i=0;i<n;i++) if (pi[i].ready) break;
+					if (i == n) {
+						misses++;
+						(void) send(c, "N", 1, MSG_NOSIGNAL);
+					} else {
+						char cbuf[CMSG_SPACE(sizeof(int))];
+						struct iovec iov = { .iov_base = "Y", .iov_len = 1 };
+						struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+							.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+						struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+						cm->cmsg_level = SOL_SOCKET;
+						cm->cmsg_type = SCM_RIGHTS;
+						cm->cmsg_len = CMSG_LEN(sizeof(int));
+						memcpy(CMSG_DATA(cm), &pi[i].conn, sizeof(int));
+						(void) sendmsg(c, &mh, MSG_NOSIGNAL);
+						hits++;
+						/* It is theirs now, refill. */
+						fdset_del(&mfds, pi[i].conn);
+						close(pi[i].conn);
+						int pc = pool_spawn(&pi[i], &mfds);
+						if (pc >= 0) {
+							close(c);
+							return pc;
+						}
+						ep_add(ep, pi[i].conn, EV_CONN);
+					}
+				}
+				close(c);
+			}
+		}
+	} while (1);
+}
+
+/* The init loop: reap children as SIGCHLD comes in, report the exit of
+ * prog through pifd, run the programs asked for on lfd (the fork server,
+ * if >=0) or on the already connected conn (if >=0), and quit when the
+ * namespace has been empty for timeout seconds (<0 = never). Empty is
+ * from cgroup.events of the jobs, if there is a cgroup, or else from
+ * pidfds of the processes in /proc. Does not return. */
+static void init_loop(pid_t prog, int pifd, int lfd, int conn, int timeout) {
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	int sfd = signalfd(-1, &chld, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) perror_msg_and_die("signalfd");
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) perror_msg_and_die("epoll_create1");
+	ep_add(ep, sfd, EV_SIG);
+	if (lfd >= 0) ep_add(ep, lfd, EV_LISTEN);
+	fcntl(pifd, F_SETFD, FD_CLOEXEC);
+	int cgev = cg_dfd >= 0 ? openat(cg_dfd, "jobs/cgroup.events", O_RDONLY|O_CLOEXEC) : -1;
+	if (cgev >= 0) {
+		/* A change is a priority event. */
+		struct epoll_event ev = { .events = EPOLLPRI, .data.u64 = EV_CGROUP | (uint32_t)cgev };
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, cgev, &ev) != 0)
+			perror_msg_and_die("epoll_ctl");
+	}
+
+	int conns = 0; /* Connections waiting for a request. */
+	if (conn >= 0) {
+		ep_add(ep, conn, EV_CONN);
+		conns++;
+		/* Tell them we are ready. */
+		(void) send(conn, "R", 1, MSG_NOSIGNAL);
+	}
+
+	int joiners = cgev >= 0 ? cg_populated(cgev) : 0; /* Tracked pidfds (or populated), -1 = someone we can only poll for. */
+	int64_t deadline = -1;
+	struct report_msg m = { 0 }; /* m.all has all that we reaped */
+	do {
+		int s;
+		pid_t r;
+		while ((r = wait4(-1, &s, WNOHANG, &m.prog)) > 0) {
+			m.retval = wait_retval(s);
+			ru_add(&m.all, &m.prog);
+			if (r == prog) {
+				/* Report that the program quit to our parent. */
+				int l = report_fd >= 0 ? sizeof(m) : 1;
+				while ((write(pifd, &m, l) == -1)&&(errno == EINTR));
+				prog = -1;
+			}
+			for (int i=0;i<njobs;i++) {
+				if (jobs[i].pid != r) continue;
+				if (jobs[i].conn >= 0) {
+					struct report_msg jm = m;
+					jm.all = m.prog; /* Just this one, the rest isnt theirs. */
+					(void) send(jobs[i].conn, &jm, jobs[i].report ? sizeof(jm) : 1, MSG_NOSIGNAL);
+					ep_close(ep, jobs[i].conn);
+				}
+				jobs[i] = jobs[--njobs];
+				break;
+			}
+		}
+		int wait_ms = -1;
+		int empty = (r == -1)&&(errno == ECHILD)&&(!conns);
+		/* No children, check for anyone that joined us. */
+		if ((empty)&&(joiners <= 0)&&(cgev < 0)) joiners = track_joiners(ep);
+		if ((empty)&&(!joiners)) {
+			int64_t now = monotime_us() / 1000;
+			if (deadline < 0) deadline = now + timeout * 1000LL;
+			if ((timeout >= 0)&&(now >= deadline)) {
+				cg_cleanup();
+				state_drop(state_dfd, lfd);
+				exit(0);
+			}
+			if (timeout >= 0) wait_ms = deadline - now;
+		} else {
+			deadline = -1;
+			if ((empty)&&(joiners < 0)) wait_ms = 3000; /* Snooze */
+		}
+
+		struct epoll_event evs[16];
+		int n = epoll_wait(ep, evs, 16, wait_ms);
+		for (int i=0;i<n;i++) {
+			int fd = (uint32_t)evs[i].data.u64;
+			uint64_t type = evs[i].data.u64 & ~0xFFFFFFFFULL;
+			if (type == EV_SIG) {
+				struct signalfd_siginfo si;
+				while (read(sfd, &si, sizeof(si)) == sizeof(si));
+			} else if (type == EV_CGROUP) {
+				/* Reading it is what clears the event. */
+				joiners = cg_populated(cgev);
+			} else if (type == EV_JOINER) {
+				/* A process that joined us has exited. */
+				joiner_gone(ep, fd);
+				if (joiners > 0) joiners--;
+			} else if (type == EV_LISTEN) {
+				conns += srv_accept(lfd, ep);
+			} else if (type == EV_CONN) {
+				int j;
+				for (j=0;j<njobs;j++) if (jobs[j].conn == fd) break;
+				if (j == njobs) {
+					/* The request. */
+					int report = 0;
+					pid_t pid = srv_spawn(fd, &report);
+					conns--;
+					if (pid < 0) {
+						ep_close(ep, fd);
+						continue;
+					}
+					jobs = realloc(jobs, (njobs + 1) * sizeof(*jobs));
+					if (!jobs) perror_msg_and_die("(re)alloc");
+					jobs[njobs].pid = pid;
+					jobs[njobs].conn = fd;
+					jobs[njobs].report = report;
+					njobs++;
+					continue;
+				}
+				/* Signals for the program, or the client went away. */
+				uint8_t sig;
+				int x = recv(fd, &sig, 1, 0);
+				if ((x == -1)&&(errno == EAGAIN)) continue;
+				if (x == 1) {
+					kill(jobs[j].pid, sig);
+					continue;
+				}
+				kill(jobs[j].pid, SIGHUP);
+				ep_close(ep, fd);
+				jobs[j].conn = -1;
+			}
+		}
+	} while(1);
+}
+
+/* The host /proc, opened before the chroot for proc_starttime(). */
+static int proc_dfd = -1;
+
+static int proc_open(void) {
+	if (proc_dfd < 0) proc_dfd = open("/proc", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	return proc_dfd;
+}
+
+/* The start time of pid (in clock ticks since boot), which tells it from
+ * a later process with the same pid. 0 if it is gone. */
+static unsigned long long proc_starttime(int pid) {
+	char fn[11+5+1];
+	snprintf(fn, sizeof(fn), "%d/stat", pid);
+	int fd = openat(proc_open(), fn, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return 0;
+	char *st = pfdreader(fd, NULL);
+	close(fd);
+	/* "pid (comm) S ...", and comm may have a ')' in it. It is field 22. */
+	char *p = strrchr(st, ')');
+	for (int f=2;(p)&&(f<22);f++) p = strchr(p + 1, ' ');
+	unsigned long long t = p ? strtoull(p + 1, NULL, 10) : 0;
+	free(st);
+	return t;
+}
+
+/* Check that pid is the pid 1 of a namespace rooted at root (if not NULL,
+ * overlaid roots cant be checked) that started at start (0 = unknown,
+ * then the root must be checked). Returns a pidfd for it,
+ * -1 if it isnt, or -2 if it is but we have no pidfds.
+ * With a pidfd, the pid cant have been reused if the pidfd is still alive
+ * after the checks, so those are about the process behind the pidfd. */
+static int pid1_open(int pid, unsigned long long start, const char *root) {
+	if ((!start)&&(!root)) return -1;
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0) {
+		if (errno != ENOSYS) return -1;
+		if ((start)&&(proc_starttime(pid) != start)) return -1;
+		/* Validate that it is an existing process and has cwd at root... */
+		char buf[6+11+4+1];
+		sprintf(buf,"/proc/%d/cwd",pid);
+		char *p = realpath(buf, NULL);
+		int r = ((p)&&(strcmp(p,"/")==0)) ? -2 : -1;
+		free(p);
+		return r;
+	}
+	if (pid1_check(pidfd, pid, start, root) != 0) {
+		close(pidfd);
+		return -1;
+	}
+	return pidfd;
+}
+
+/* The checks of pid1_open(), on the process behind pidfd. 0 if it is the one. */
+static int pid1_check(int pidfd, int pid, unsigned long long start, const char *root) {
+	char buf[6+11+5+1]; /* Enough for /proc/N/root */
+	if ((!start)&&(!root)) return -1;
+
+	/* Its pid in the innermost pid namespace (last on NSpid:) must be 1. */
+	char fn[6+4+8+10+1];
+	sprintf(fn, "/proc/self/fdinfo/%d", pidfd);
+	int fd = open(fn, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return -1;
+	char *info = pfdreader(fd, NULL);
+	close(fd);
+	char *ns = strstr(info, "NSpid:");
+	if (ns) {
+		char *e = strchr(ns, '\n');
+		if (e) *e = 0;
+		e = strrchr(ns, '\t');
+		if ((!e)||(strcmp(e+1, "1") != 0)) ns = NULL;
+	} else {
+		ns = info; /* Too old to tell, let the root check decide. */
+	}
+	free(info);
+	if (!ns) return -1;
+
+	/* It must be the one that was started. */
+	if ((start)&&(proc_starttime(pid) != start)) return -1;
+
+	/* Its root must be the directory. */
+	struct stat a, b;
+	sprintf(buf, "/proc/%d/root", pid);
+	if ((root)&&((stat(buf, &a) != 0)||(stat(root, &b) != 0))) return -1;
+	if ((root)&&((a.st_dev != b.st_dev)||(a.st_ino != b.st_ino))) return -1;
+
+	/* And it must still be the same process. */
+	return syscall(SYS_pidfd_send_signal, pidfd, 0, NULL, 0) != 0 ? -1 : 0;
+}
+
+/* List the named instances that are up: from the runtime directory,
+ * without going through /proc. Ones that are gone get cleaned up. */
+void nsc_list(void) {
+	state_base = state_base_open(getuid());
+	DIR *d = fdopendir(openat(state_base, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if (!d) perror_msg_and_die("fdopendir");
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.') continue;
+		int dfd = openat(state_base, de->d_name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (dfd < 0) continue;
+		/* From the init itself, or its .pid1 (and start time). */
+		int pid = 0;
+		int pidfd = srv_pidfd(dfd, &pid, NULL);
+		int fd = pidfd < 0 ? openat(dfd, PID1_FN, O_RDONLY|O_CLOEXEC) : -1;
+		if ((pidfd < 0)&&(fd < 0)) { /* Starting up, or just a pool. */
+			close(dfd);
+			continue;
+		}
+		if (fd >= 0) {
+			char *p1 = pfdreader(fd, NULL);
+			close(fd);
+			unsigned long long start = 0;
+			sscanf(p1, "%d %llu", &pid, &start);
+			free(p1);
+			pidfd = pid > 0 ? pid1_open(pid, start, NULL) : -1;
+		}
+		if (pidfd == -1) {
+			state_name = de->d_name;
+			state_drop(dfd, 0);
+			close(dfd);
+			continue;
+		}
+		if (pidfd >= 0) close(pidfd);
+
+		char *info = NULL;
+		fd = openat(dfd, INFO_FN, O_RDONLY|O_CLOEXEC);
+		if (fd >= 0) {
+			info = pfdreader(fd, NULL);
+			close(fd);
+		}
+		/* start time, root and command line, tab separated */
+		char *root = info ? strchr(info, '\t') : NULL;
+		if (root) *root++ = 0;
+		char *cmd = root ? strchr(root, '\t') : NULL;
+		if (cmd) *cmd++ = 0;
+		char tbuf[32] = "-";
+		time_t t = info ? atoll(info) : 0;
+		struct tm tm;
+		if ((t)&&(localtime_r(&t, &tm))) strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s\t%d\t%s\t%s\t%s\n", de->d_name, pid, tbuf, root ? root : "-", cmd ? cmd : "-");
+		free(info);
+		close(dfd);
+	}
+	closedir(d);
+	close(state_base);
+	state_base = -1;
+	state_name = NULL;
+}
+
+static char * pmountsreader(void) {
+	int fd = open("/proc/self/mountinfo", O_RDONLY);
+	if (fd < 0) return NULL;
+	char * d = pfdreader(fd, NULL);
+	close(fd);
+	return d;
+}
+
+struct mntent_s {
+	int id;
+	int parent;
+	int depth;
+	char *path;
+};
+
+static int mntent_id_cmp(const void *a, const void *b) {
+	return ((const struct mntent_s*)a)->id - ((const struct mntent_s*)b)->id;
+}
+
+static int mntent_depth_cmp(const void *a, const void *b) {
+	const struct mntent_s *x = a, *y = b;
+	if (x->depth != y->depth) return y->depth - x->depth;
+	return y->id - x->id; /* Stacked on the same depth: newest first. */
+}
+
+/* Depth of a mount in the mount tree, list sorted by id. */
+static int mntent_depth(struct mntent_s *m, int n, struct mntent_s *e) {
+	if (e->depth >= 0) return e->depth;
+	e->depth = 0; /* Also breaks any loops. */
+	struct mntent_s key = { .id = e->parent };
+	struct mntent_s *p = bsearch(&key, m, n, sizeof(*m), mntent_id_cmp);
+	if ((p)&&(p != e)) e->depth = mntent_depth(m, n, p) + 1;
+	return e->depth;
+}
+
+static void umountizer(const char *prefix) {
+	int plen = strlen(prefix);
+	/* Unmount everything, in one pass over mountinfo, deepest mounts first.
+	 * That way a mount that we cannot take out (eg. locked in an user ns)
+	 * is tried before the parent that would take it along with it. */
+	char * mounts = pmountsreader();
+	if (!mounts) return;
+	int n = 0, ma = 0;
+	struct mntent_s *m = NULL;
+	char * pp = mounts;
+	char * nl;
+	do {
+		/* Find the next line beforehand, because we edit part of line in-place. */
+		nl = strchr(pp, '\n');
+		if (nl) *nl++ = 0;
+
+		/* "id parent maj:min root mountpoint ..." */
+		int id, parent, o = 0;
+		if (sscanf(pp, "%d %d %*s %*s %n", &id, &parent, &o) < 2 || !o) continue;
+		char *ns1 = pp + o;
+		char *ns2 = strchr(ns1, ' ');
+		if (!ns2) continue;
+
+		/* In-place convert out octal escapes from the path and make it into a C-string. */
+		int l = ns2 - ns1;
+		int wi = 0;
+		for (int i=0;i<l;i++) {
+			if (ns1[i] == '\\') {
+				ns1[wi++] = ((ns1[i+1] << 6) & 0300) | ((ns1[i+2] << 3) & 0070) | (ns1[i+3] & 0007);
+				i += 3; /* skip the octal value */
+				continue;
+			}
+			ns1[wi++] = ns1[i];
+		}
+		ns1[wi] = 0;
+
+		if (n == ma) {
+			ma += 256;
+			m = realloc(m, ma * sizeof(*m));
+			if (!m) perror_msg_and_die("(re)alloc");
+		}
+		m[n].id = id;
+		m[n].parent = parent;
+		m[n].depth = -1;
+		m[n].path = ns1;
+		n++;
+	} while ((pp = nl));
+
+	qsort(m, n, sizeof(*m), mntent_id_cmp);
+	for (int i=0;i<n;i++) mntent_depth(m, n, &m[i]);
+	qsort(m, n, sizeof(*m), mntent_depth_cmp);
+
+	for (int i=0;i<n;i++) {
+		int mlen = plen;
+		int wi = strlen(m[i].path);
+		if (mlen > wi) mlen = wi;
+
+		/* If the result doesnt match prefix, try unmounting it */
+		if ((strncmp(prefix, m[i].path, mlen) != 0))
+			(void) trace_mnt(umount2(m[i].path, MNT_DETACH));
+	}
+	free(m);
+	free(mounts);
+}
+
+/* Mount an overlay over path, with path as the lower layer. The upper
+ * and work directories are in the directory upper, or in a tmpfs if upper
+ * is "-". This must look them up in the new mount namespace. */
+static void overlay_mount(const char *path, const char *upper, int muid) {
+	int lfd = open(path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (lfd < 0) perror_msg_and_die2("open", path);
+	if (strcmp(upper, "-") == 0) {
+		if (trace_mnt(mount("tmpfs", path, "tmpfs", 0, "mode=0755")) != 0)
+			perror_msg_and_die("mount tmpfs upper");
+		upper = path;
+	}
+	int dfd = open(upper, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (dfd < 0) perror_msg_and_die2("open", upper);
+	(void) mkdirat(dfd, "upper", 0755);
+	(void) mkdirat(dfd, "work", 0755);
+	int ufd = openat(dfd, "upper", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	int wfd = openat(dfd, "work", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if ((ufd < 0)||(wfd < 0)) perror_msg_and_die("open upper/work");
+
+	/* Via /proc/self/fd, so the paths need no escaping. */
+	char opts[160];
+	snprintf(opts, sizeof(opts), "lowerdir=/proc/self/fd/%d,upperdir=/proc/self/fd/%d,"
+		"workdir=/proc/self/fd/%d%s", lfd, ufd, wfd, muid ? ",userxattr" : "");
+	if (trace_mnt(mount("overlay", path, "overlay", 0, opts)) != 0)
+		perror_msg_and_die("mount overlay");
+	close(lfd);
+	close(ufd);
+	close(wfd);
+	close(dfd);
+}
+
+/* Attach the detached tree tfd on top of /, with private propagation,
+ * and go there. Takes tfd. */
+static int attach_root(int tfd) {
+	struct nsc_mount_attr a = { .propagation = MS_PRIVATE };
+	if ((trace_mnt(syscall(SYS_mount_setattr, tfd, "", AT_EMPTY_PATH|AT_RECURSIVE, &a, sizeof(a))) != 0) ||
+		(trace_mnt(syscall(SYS_move_mount, tfd, "", AT_FDCWD, "/", MOVE_MOUNT_F_EMPTY_PATH)) != 0)) {
+		close(tfd);
+		return -1;
+	}
+
+	/* Our root is still the old one, but the cwd is now in the new tree. */
+	if (fchdir(tfd) != 0)
+		perror_msg_and_die("fchdir(tree)");
+	close(tfd);
+	return 0;
+}
+
+/* Attach a detached clone of just the rootfs subtree on top of /,
+ * with private propagation, and go there. Returns -1 without having
+ * changed anything if the kernel cant do this. */
+static int detached_root(const char *path) {
+	int tfd = trace_mnt(syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|AT_RECURSIVE));
+	if (tfd < 0) return -1;
+	return attach_root(tfd);
+}
+
+/* Booting from a (read-only) image file instead of a directory. As root
+ * it is mounted from a loop device, as an user by a FUSE driver. */
+struct image {
+	int fd;
+	char *fn;
+	const char *type;
+	const char *fuse;
+	int go; /* Starts the driver once the mount is there. */
+};
+
+static const struct {
+	const char *type, *fuse;
+	int off, len;
+	const char *magic;
+} image_types[] = {
+	{ "erofs", "erofsfuse", 1024, 4, "\xe2\xe1\xf5\xe0" },
+	{ "squashfs", "squashfuse", 0, 4, "hsqs" },
+	{ "ext4", "fuse2fs", 1080, 2, "\x53\xef" },
+};
+
+static void image_open(struct image *im, const char *fn) {
+	im->fd = open(fn, O_RDONLY|O_CLOEXEC);
+	if (im->fd < 0) perror_msg_and_die2("open", fn);
+	im->fn = realpath(fn, NULL);
+	if (!im->fn) perror_msg_and_die("realpath");
+	im->type = NULL;
+	for (int i=0;i<sizeof(image_types)/sizeof(image_types[0]);i++) {
+		char m[4];
+		if ((pread(im->fd, m, image_types[i].len, image_types[i].off) == image_types[i].len) &&
+			(memcmp(m, image_types[i].magic, image_types[i].len) == 0)) {
+			im->type = image_types[i].type;
+			im->fuse = image_types[i].fuse;
+			break;
+		}
+	}
+	if (!im->type) error_msg_and_die("Unknown image type (erofs, squashfs or ext4 please)");
+	im->go = -1;
+}
+
+/* The FUSE driver runs outside of the namespaces (so it goes away with
+ * the mount), started before unsharing. It waits for the /dev/fuse fd,
+ * which has to be opened in the user namespace of the mount. It needs
+ * a libfuse that takes /dev/fd/N as the mount point (fuse3 >= 3.3). */
+static void image_fuse(struct image *im) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, sv) != 0) perror_msg_and_die("socketpair");
+	pid_t pid = fork();
+	if (pid == -1) perror_msg_and_die("fork");
+	if (!pid) {
+		int fd;
+		char c, mp[32];
+		char cbuf[CMSG_SPACE(sizeof(fd))];
+		struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		close(sv[1]);
+		if (recvmsg(sv[0], &mh, 0) != 1) _exit(1);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if ((!cm)||(cm->cmsg_type != SCM_RIGHTS)) _exit(1);
+		memcpy(&fd, CMSG_DATA(cm), sizeof(fd));
+		snprintf(mp, sizeof(mp), "/dev/fd/%d", fd);
+		execlp(im->fuse, im->fuse, "-f", im->fn, mp, NULL);
+		perror_msg_and_die2("exec", im->fuse);
+	}
+	close(sv[0]);
+	im->go = sv[1];
+}
+
+/* A loop device with the image, read-only. One that already has it is
+ * reused, the instances then share the superblock (and page cache). */
+static int image_loop(struct image *im) {
+	struct stat st;
+	char dn[sizeof(((struct dirent*)0)->d_name) + 5];
+	int lfd;
+	if (fstat(im->fd, &st) != 0) perror_msg_and_die("fstat(image)");
+
+	DIR *d = opendir("/sys/block");
+	struct dirent *de;
+	while ((d)&&(de = readdir(d))) {
+		struct loop_info64 li;
+		if (strncmp(de->d_name, "loop", 4) != 0) continue;
+		snprintf(dn, sizeof(dn), "/dev/%s", de->d_name);
+		lfd = open(dn, O_RDONLY|O_CLOEXEC);
+		if (lfd < 0) continue;
+		if ((ioctl(lfd, LOOP_GET_STATUS64, &li) == 0)&&(li.lo_device == st.st_dev)&&
+			(li.lo_inode == st.st_ino)&&(!li.lo_offset)&&(!li.lo_sizelimit)&&
+			(li.lo_flags & LO_FLAGS_READ_ONLY)) {
+			closedir(d);
+			return lfd;
+		}
+		close(lfd);
+	}
+	if (d) closedir(d);
+
+	int cfd = open("/dev/loop-control", O_RDWR|O_CLOEXEC);
+	if (cfd < 0) perror_msg_and_die("open /dev/loop-control");
+	struct loop_config lc = { .fd = im->fd,
+		.info.lo_flags = LO_FLAGS_READ_ONLY|LO_FLAGS_AUTOCLEAR|LO_FLAGS_DIRECT_IO };
+	for (int tries=0;tries<16;tries++) {
+		int n = ioctl(cfd, LOOP_CTL_GET_FREE);
+		if (n < 0) perror_msg_and_die("LOOP_CTL_GET_FREE");
+		snprintf(dn, sizeof(dn), "/dev/loop%d", n);
+		lfd = open(dn, O_RDONLY|O_CLOEXEC);
+		if (lfd < 0) perror_msg_and_die2("open", dn);
+		if (ioctl(lfd, LOOP_CONFIGURE, &lc) == 0) {
+			close(cfd);
+			return lfd;
+		}
+		close(lfd);
+		/* No direct IO on the filesystem of the image. */
+		if ((errno == EINVAL)&&(lc.info.lo_flags & LO_FLAGS_DIRECT_IO))
+			lc.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		else if (errno != EBUSY) /* else someone else took it */
+			perror_msg_and_die("LOOP_CONFIGURE");
+	}
+	error_msg_and_die("No free loop device");
+	return -1;
+}
+
+/* Mount the image with an overlay on it as the new root, and go there.
+ * The mount points are in a scratch tmpfs on top of / (there is nowhere
+ * else), that is detached once the overlay is cloned out of it. */
+static void image_root(struct image *im, const char *upper, int muid) {
+	int sfd = trace_mnt(syscall(SYS_fsopen, "tmpfs", FSOPEN_CLOEXEC));
+	if (sfd < 0) perror_msg_and_die("fsopen");
+	if (trace_mnt(syscall(SYS_fsconfig, sfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) != 0)
+		perror_msg_and_die("fsconfig");
+	int mfd = trace_mnt(syscall(SYS_fsmount, sfd, FSMOUNT_CLOEXEC, 0));
+	if (mfd < 0) perror_msg_and_die("fsmount");
+	close(sfd);
+	if (trace_mnt(syscall(SYS_move_mount, mfd, "", AT_FDCWD, "/", MOVE_MOUNT_F_EMPTY_PATH)) != 0)
+		perror_msg_and_die("move_mount(scratch)");
+	if (fchdir(mfd) != 0) perror_msg_and_die("fchdir(scratch)");
+	close(mfd);
+	(void) mkdir("lower", 0755);
+
+	if (muid) {
+		char opts[96];
+		int fd = open("/dev/fuse", O_RDWR|O_CLOEXEC);
+		if (fd < 0) perror_msg_and_die("open /dev/fuse");
+		snprintf(opts, sizeof(opts), "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other", fd);
+		if (trace_mnt(mount(im->fn, "lower", "fuse", MS_RDONLY|MS_NOSUID|MS_NODEV, opts)) != 0)
+			perror_msg_and_die("mount fuse");
+
+		char c = 0, cbuf[CMSG_SPACE(sizeof(fd))];
+		struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(fd));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(fd));
+		if (sendmsg(im->go, &mh, 0) != 1) perror_msg_and_die("start fuse driver");
+		close(im->go);
+		close(fd);
+	} else {
+		int lfd = image_loop(im);
+		char dn[32];
+		snprintf(dn, sizeof(dn), "/proc/self/fd/%d", lfd);
+		if (trace_mnt(mount(dn, "lower", im->type, MS_RDONLY, NULL)) != 0)
+			perror_msg_and_die2("mount", im->fn);
+		close(lfd);
+	}
+	overlay_mount("lower", upper, muid);
+
+	int tfd = trace_mnt(syscall(SYS_open_tree, AT_FDCWD, "lower", OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|AT_RECURSIVE));
+	if (tfd < 0) perror_msg_and_die("open_tree(image)");
+	if (trace_mnt(umount2(".", MNT_DETACH)) != 0) perror_msg_and_die("umount(scratch)");
+	if (attach_root(tfd) != 0) perror_msg_and_die("move_mount(image)");
+}
+
+/* tmpfs mounts (-T, -W dir[:opts[:seed]]). opts go to the mount as is
+ * (size=, nr_inodes=, mode=, huge=), and the seed is a directory or an
+ * (uncompressed) tar file copied in when the instance starts. The seed
+ * is opened here, it might not be reachable from the new root. */
+struct tmpfs_mnt {
+	char *dir;
+	char *opts;
+	int flags;
+	int seed;
+	int seed_dir;
+};
+static int tar_ok(const char *h);
+
+static struct tmpfs_mnt *tmpfs_mnts = NULL;
+static int ntmpfs = 0;
+
+static void tmpfs_add(char *spec, int flags) {
+	struct tmpfs_mnt t = { .dir = spec, .flags = flags, .seed = -1 };
+	char *seed = NULL;
+	char *c = strchr(spec, ':');
+	if (c) {
+		*c++ = 0;
+		t.opts = c;
+		seed = strchr(c, ':');
+		if (seed) *seed++ = 0;
+		if (!*t.opts) t.opts = NULL;
+	}
+	if (t.dir[0] != '/') error_msg_and_die("tmpfs dir must be an absolute path");
+	if ((seed)&&(*seed)) {
+		struct stat st;
+		t.seed = open(seed, O_RDONLY|O_CLOEXEC);
+		if ((t.seed < 0)||(fstat(t.seed, &st) != 0)) perror_msg_and_die2("open", seed);
+		t.seed_dir = S_ISDIR(st.st_mode);
+		/* Tell now, and not from the namespace, if it is not a tar. */
+		char h[512];
+		if ((!t.seed_dir)&&(pread(t.seed, h, 512, 0) == 512)&&(h[0])&&(!tar_ok(h)))
+			error_msg_and_die("seed: not a tar");
+	}
+	tmpfs_mnts = realloc(tmpfs_mnts, (ntmpfs + 1) * sizeof(struct tmpfs_mnt));
+	if (!tmpfs_mnts) perror_msg_and_die("(re)alloc");
+	tmpfs_mnts[ntmpfs++] = t;
+}
+
+/* Open path in dfd as an O_PATH fd (plus flags), resolved beneath it
+ * or with it as the root, as resolve says. */
+static int open_in(int dfd, const char *path, int flags, uint64_t resolve) {
+	struct open_how how = { .flags = O_PATH|O_CLOEXEC|flags,
+		.resolve = resolve|RESOLVE_NO_MAGICLINKS };
+	return syscall(SYS_openat2, dfd, path, &how, sizeof(how));
+}
+
+/* The directory of path in dfd (resolved as with open_in), so that no
+ * symlink in there can take it elsewhere. The missing ones are made
+ * (with mk). Returns it and the last part of path in *last, or -1. */
+static int open_parent(int dfd, char *path, char **last, int mk, uint64_t resolve) {
+	char *s = strrchr(path, '/');
+	*last = s ? s + 1 : path;
+	if (!s) return open_in(dfd, ".", O_DIRECTORY, resolve);
+	*s = 0;
+	int fd = open_in(dfd, path, O_DIRECTORY, resolve);
+	if ((fd < 0)&&(errno == ENOENT)&&(mk)) {
+		fd = open_in(dfd, ".", O_DIRECTORY, resolve);
+		for (char *p = path; (fd >= 0)&&(p); ) {
+			char *c = p;
+			p = strchr(p, '/');
+			if (p) *p = 0;
+			(void) mkdirat(fd, c, 0755);
+			close(fd);
+			fd = open_in(dfd, path, O_DIRECTORY, resolve);
+			if (p) *p++ = '/';
+		}
+	}
+	*s = '/';
+	return fd;
+}
+
+/* mkdir -p, relative to dfd. */
+static void mkdirs(int dfd, char *path, mode_t mode) {
+	for (char *p = path+1; *p; p++) {
+		if (*p != '/') continue;
+		*p = 0;
+		(void) mkdirat(dfd, path, 0755);
+		*p = '/';
+	}
+	(void) mkdirat(dfd, path, mode);
+}
+
+static void seed_attrs(int dfd, const char *n, const struct stat *st) {
+	/* Fails for the ids not mapped as an user, fine. */
+	(void) fchownat(dfd, n, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+	if (!S_ISLNK(st->st_mode)) (void) fchmodat(dfd, n, st->st_mode & 07777, 0);
+}
+
+/* Copy the tree at sfd into dfd. Takes sfd. */
+static void seed_dir(int sfd, int dfd) {
+	DIR *d = fdopendir(sfd);
+	if (!d) {
+		perror("seed fdopendir");
+		close(sfd);
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		const char *n = de->d_name;
+		struct stat st;
+		if ((strcmp(n, ".") == 0)||(strcmp(n, "..") == 0)) continue;
+		if (fstatat(sfd, n, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			perror2("seed stat", n);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			(void) mkdirat(dfd, n, 0700);
+			int s = openat(sfd, n, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			int t = openat(dfd, n, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if ((s >= 0)&&(t >= 0)) seed_dir(s, t);
+			else perror2("seed dir", n);
+			if ((s >= 0)&&(t < 0)) close(s);
+			if (t >= 0) close(t);
+		} else if (S_ISREG(st.st_mode)) {
+			int s = openat(sfd, n, O_RDONLY|O_CLOEXEC);
+			int t = openat(dfd, n, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+			if ((s < 0)||(t < 0)||(copy_data(s, t, 0, st.st_size) != 0))
+				perror2("seed file", n);
+			if (s >= 0) close(s);
+			if (t >= 0) close(t);
+		} else if (S_ISLNK(st.st_mode)) {
+			char l[PATH_MAX];
+			ssize_t ll = readlinkat(sfd, n, l, sizeof(l)-1);
+			if (ll < 0) continue;
+			l[ll] = 0;
+			if (symlinkat(l, dfd, n) != 0) perror2("seed symlink", n);
+		} else {
+			/* Devices fail as an user, fifos and sockets dont. */
+			if (mknodat(dfd, n, st.st_mode, st.st_rdev) != 0) continue;
+		}
+		seed_attrs(dfd, n, &st);
+	}
+	closedir(d);
+}
+
+/* A number field of a tar header: octal, or base-256 for the big ones. */
+static long long tar_num(const char *f, int n) {
+	long long v = 0;
+	if (f[0] & 0x80) {
+		for (int i=1;i<n;i++) v = (v << 8) | (unsigned char)f[i];
+		return v;
+	}
+	for (int i=0;i<n;i++) {
+		if ((f[i] >= '0')&&(f[i] <= '7')) v = v*8 + f[i] - '0';
+		else if ((f[i] != ' ')||(v)) break;
+	}
+	return v;
+}
+
+static char *tar_str(int tfd, off_t off, long long len) {
+	if ((len < 0)||(len > (1<<20))) return NULL;
+	char *s = malloc(len+1);
+	if (!s) perror_msg_and_die("malloc");
+	if (pread(tfd, s, len, off) != len) len = 0;
+	s[len] = 0;
+	return s;
+}
+
+/* The path and linkpath records of a pax extended header. */
+static void tar_pax(char *p, long long len, char **path, char **link) {
+	char *e = p + len;
+	while (p < e) {
+		char *sp;
+		long l = strtol(p, &sp, 10);
+		if ((l <= 0)||(l > e - p)||(*sp != ' ')) break;
+		p[l-1] = 0;
+		if (strncmp(sp+1, "path=", 5) == 0) {
+			free(*path);
+			*path = strdup(sp+6);
+		} else if (strncmp(sp+1, "linkpath=", 9) == 0) {
+			free(*link);
+			*link = strdup(sp+10);
+		}
+		p += l;
+	}
+}
+
+/* Make a tar member name relative, and refuse any with "..". */
+static char *tar_path(char *n) {
+	while ((*n == '/')||((n[0] == '.')&&(n[1] == '/'))) n += (*n == '/') ? 1 : 2;
+	int l = strlen(n);
+	while ((l)&&(n[l-1] == '/')) n[--l] = 0;
+	if ((!l)||(strcmp(n, ".") == 0)) return NULL;
+	for (char *c = n; c; c = strchr(c, '/')) {
+		if (*c == '/') c++;
+		if ((c[0] == '.')&&(c[1] == '.')&&((c[2] == '/')||(!c[2]))) return NULL;
+	}
+	return n;
+}
+
+/* Is the checksum of the header right. It is of the header with the
+ * checksum as spaces, some old tars summed signed chars. */
+static int tar_ok(const char *h) {
+	long long u = 0, sg = 0;
+	for (int i=0;i<512;i++) {
+		char c = ((i >= 148)&&(i < 156)) ? ' ' : h[i];
+		u += (unsigned char)c;
+		sg += (signed char)c;
+	}
+	long long ck = tar_num(h+148, 8);
+	return (ck == u)||(ck == sg);
+}
+
+/* Extract a tar file (ustar, with the gnu and pax long names) into dfd.
+ * The file data goes straight from the tar file with sendfile. */
+static void seed_tar(int tfd, int dfd) {
+	char h[512];
+	char *lpath = NULL, *llink = NULL;
+	off_t off = 0;
+	while (pread(tfd, h, 512, off) == 512) {
+		if (!h[0]) break;
+		if (!tar_ok(h)) error_msg_and_die("seed: not a tar");
+		long long size = tar_num(h+124, 12);
+		char type = h[156];
+		off_t data = off + 512;
+		off = data + ((size + 511) & ~511LL);
+
+		if ((type == 'L')||(type == 'K')) {
+			char **s = type == 'L' ? &lpath : &llink;
+			free(*s);
+			*s = tar_str(tfd, data, size);
+			continue;
+		}
+		if (type == 'x') {
+			char *p = tar_str(tfd, data, size);
+			if (p) tar_pax(p, size, &lpath, &llink);
+			free(p);
+			continue;
+		}
+		if (type == 'g') continue;
+
+		char nbuf[257], lbuf[101];
+		if ((memcmp(h+257, "ustar", 5) == 0)&&(h[345]))
+			snprintf(nbuf, sizeof(nbuf), "%.155s/%.100s", h+345, h);
+		else
+			snprintf(nbuf, sizeof(nbuf), "%.100s", h);
+		snprintf(lbuf, sizeof(lbuf), "%.100s", h+157);
+		char *n = tar_path(lpath ? lpath : nbuf);
+		char *link = llink ? llink : lbuf;
+
+		struct stat st = { .st_mode = tar_num(h+100, 8) & 07777,
+			.st_uid = tar_num(h+108, 8), .st_gid = tar_num(h+116, 8) };
+		if ((type != '5')&&(type != '2')&&(type != '1')&&(type != '0')&&(type != '7')&&(type))
+			n = NULL; /* Devices, fifos: not for a tmpfs seed. */
+		/* Beneath the tmpfs, the symlinks of the earlier members
+		 * must not take them out of it. */
+		char *last = NULL;
+		int pfd = n ? open_parent(dfd, n, &last, 1, RESOLVE_BENEATH) : -1;
+		int r = -1;
+		if (pfd >= 0) switch (type) {
+			case '5':
+				st.st_mode |= S_IFDIR;
+				r = mkdirat(pfd, last, 0700);
+				if ((r != 0)&&(errno == EEXIST)) {
+					/* One that is there is fine, a symlink to one is not. */
+					struct stat ost;
+					r = (fstatat(pfd, last, &ost, AT_SYMLINK_NOFOLLOW) == 0)&&(S_ISDIR(ost.st_mode)) ? 0 : -1;
+				}
+				break;
+			case '2':
+				st.st_mode |= S_IFLNK;
+				r = symlinkat(link, pfd, last);
+				break;
+			case '1': {
+				char *t = tar_path(link), *tl;
+				int sfd = t ? open_parent(dfd, t, &tl, 0, RESOLVE_BENEATH) : -1;
+				r = sfd < 0 ? -1 : linkat(sfd, tl, pfd, last, 0);
+				if (sfd >= 0) close(sfd);
+				break;
+			}
+			default: {
+				int fd = openat(pfd, last, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+				r = fd < 0 ? -1 : copy_data(tfd, fd, data, size);
+				if (fd >= 0) close(fd);
+				break;
+			}
+		}
+		if ((n)&&(r != 0)) perror2("seed", n);
+		else if ((n)&&(type != '1')) seed_attrs(pfd, last, &st);
+		if (pfd >= 0) close(pfd);
+		free(lpath);
+		free(llink);
+		lpath = llink = NULL;
+	}
+	free(lpath);
+	free(llink);
+}
+
+/* Mount the tmpfses, in the new root. */
+static void tmpfs_mount(void) {
+	for (int i=0;i<ntmpfs;i++) {
+		struct tmpfs_mnt *t = &tmpfs_mnts[i];
+		mkdirs(AT_FDCWD, t->dir, 01777);
+		if (trace_mnt(mount("tmpfs", t->dir, "tmpfs", MS_NOSUID|MS_NODEV|t->flags, t->opts)) != 0) {
+			perror2("mount tmpfs", t->dir);
+			continue;
+		}
+		if (t->seed < 0) continue;
+		int dfd = open(t->dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (dfd < 0) {
+			perror2("open", t->dir);
+			continue;
+		}
+		/* A new open file for readdir, a pool spawns many from one seed. */
+		if (t->seed_dir) seed_dir(openat(t->seed, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC), dfd);
+		else seed_tar(t->seed, dfd);
+		close(dfd);
+	}
+}
+
+/* Host paths bound into the new root (-B host[:guest[:ro]]), done before
+ * the old root goes away. A read-only one is made so (recursively) while
+ * still detached, so it is never writable in the instance. */
+struct bind_mnt {
+	char *host;
+	char *guest;
+	int ro;
+};
+static struct bind_mnt *binds = NULL;
+static int nbinds = 0;
+
+static void bind_add(char *spec) {
+	struct bind_mnt b = { .host = spec, .guest = spec };
+	char *c = strchr(spec, ':');
+	if (c) {
+		*c++ = 0;
+		b.guest = c;
+		c = strchr(c, ':');
+		if (c) *c++ = 0;
+		if ((c)&&(strcmp(c, "ro") == 0)) b.ro = 1;
+		else if ((c)&&(strcmp(c, "rw") != 0)) error_msg_and_die("bind mount flags are ro or rw");
+	}
+	if (!*b.guest) b.guest = b.host;
+	b.guest += strspn(b.guest, "/"); /* Relative to the new root. */
+	if ((b.host[0] != '/')||(!*b.guest)) error_msg_and_die("bind mounts are /host[:/guest[:ro]]");
+	binds = realloc(binds, (nbinds + 1) * sizeof(struct bind_mnt));
+	if (!binds) perror_msg_and_die("(re)alloc");
+	binds[nbinds++] = b;
+}
+
+/* Do the bind mounts, in the new root (the cwd). The guest paths are
+ * resolved with it as the root, as its absolute symlinks would point
+ * to the host otherwise. */
+static void bind_mount(void) {
+	int rfd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (rfd < 0) perror_msg_and_die("open(root)");
+	for (int i=0;i<nbinds;i++) {
+		struct bind_mnt *b = &binds[i];
+		struct stat st;
+		if (stat(b->host, &st) != 0) {
+			perror2("bind", b->host);
+			continue;
+		}
+		char *last;
+		int pfd = open_parent(rfd, b->guest, &last, 1, RESOLVE_IN_ROOT);
+		if (pfd >= 0) {
+			if (S_ISDIR(st.st_mode)) {
+				(void) mkdirat(pfd, last, 0755);
+			} else {
+				int fd = openat(pfd, last, O_WRONLY|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+				if (fd >= 0) close(fd);
+			}
+			close(pfd);
+		}
+		int gfd = open_in(rfd, b->guest, 0, RESOLVE_IN_ROOT);
+		if (gfd < 0) {
+			perror2("bind", b->guest);
+			continue;
+		}
+
+		int tfd = trace_mnt(syscall(SYS_open_tree, AT_FDCWD, b->host, OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|AT_RECURSIVE));
+		if (tfd >= 0) {
+			struct nsc_mount_attr a = { .attr_set = b->ro ? MOUNT_ATTR_RDONLY : 0 };
+			if ((b->ro)&&(trace_mnt(syscall(SYS_mount_setattr, tfd, "", AT_EMPTY_PATH|AT_RECURSIVE, &a, sizeof(a))) != 0))
+				perror2("mount_setattr", b->host);
+			else if (trace_mnt(syscall(SYS_move_mount, tfd, "", gfd, "", MOVE_MOUNT_F_EMPTY_PATH|MOVE_MOUNT_T_EMPTY_PATH)) != 0)
+				perror2("move_mount", b->host);
+			close(tfd);
+			close(gfd);
+			continue;
+		}
+		/* Older kernels: only the top mount gets to be read-only. */
+		char fn[32];
+		snprintf(fn, sizeof(fn), "/proc/self/fd/%d", gfd);
+		if (trace_mnt(mount(b->host, fn, NULL, MS_BIND|MS_REC, NULL)) != 0) {
+			perror2("bind mount", b->host);
+			close(gfd);
+			continue;
+		}
+		/* The fd is of what was under it, the remount is for the new one. */
+		close(gfd);
+		gfd = open_in(rfd, b->guest, 0, RESOLVE_IN_ROOT);
+		snprintf(fn, sizeof(fn), "/proc/self/fd/%d", gfd);
+		if ((b->ro)&&((gfd < 0)||(trace_mnt(mount(NULL, fn, NULL, MS_REMOUNT|MS_BIND|MS_RDONLY, NULL)) != 0)))
+			perror2("remount ro", b->host);
+		if (gfd >= 0) close(gfd);
+	}
+	close(rfd);
+}
+
+void nsc_config_init(struct nsc_config *c) {
+	memset(c, 0, sizeof(*c));
+	c->initmode = 2;
+	c->entermode = 2;
+	c->automounts = 2;
+	c->init_timeout = 5;
+	c->batch_jobs = 1;
+	c->trace_fd = -1;
+}
+
+/* One allocation: the pointers, and after them room for the numbers. */
+char **nsc_args(const struct nsc_config *c) {
+	int max = 48 + 2 * (c->nlimits + c->ntmpfs + c->nbinds);
+	for (char **a = c->argv; (a)&&(*a); a++) max++;
+	char **v = malloc(max * sizeof(char*) + 4 * 12);
+	if (!v) return NULL;
+	char *num = (char*)(v + max);
+	int n = 0;
+#define NSC_NUM(opt, val) do { v[n++] = opt; v[n++] = num; num += sprintf(num, "%d", val) + 1; } while (0)
+#define NSC_STR(opt, val) do { if (val) { v[n++] = opt; v[n++] = (char*)(val); } } while (0)
+	v[n++] = (char*)(c->helper ? c->helper : "nschrooter");
+	if (c->initmode != 2) v[n++] = c->initmode ? "-i" : "-b";
+	if (c->entermode != 2) v[n++] = c->entermode ? "-E" : "-k";
+	if (c->automounts != 2) v[n++] = c->automounts ? "-A" : "-N";
+	if (c->use_srv) v[n++] = "-S";
+	if (c->use_pool) v[n++] = "-p";
+	if (c->clean_env) v[n++] = "-c";
+	if (c->use_filter) v[n++] = "-F";
+	if (c->tmp) v[n++] = "-T";
+	if (c->capture_live) v[n++] = "-V";
+	if (c->pool_size > 0) NSC_NUM("-P", c->pool_size);
+	if (c->init_timeout != 5) NSC_NUM("-t", c->init_timeout);
+	if (c->batch_jobs != 1) NSC_NUM("-j", c->batch_jobs);
+	if (c->trace_fd >= 0) NSC_NUM("-x", c->trace_fd);
+	if ((c->overlay)&&(strcmp(c->overlay, "-") == 0)) v[n++] = "-O";
+	else NSC_STR("-o", c->overlay);
+	NSC_STR("-M", c->hostname);
+	NSC_STR("-r", c->old_root);
+	NSC_STR("-n", c->name);
+	NSC_STR("-m", c->batch);
+	NSC_STR("-G", c->cg_parent);
+	NSC_STR("-C", c->capture);
+	NSC_STR("-R", c->report);
+	for (int i=0;i<c->nlimits;i++) NSC_STR("-L", c->limits[i]);
+	for (int i=0;i<c->ntmpfs;i++) NSC_STR("-W", c->tmpfs[i]);
+	for (int i=0;i<c->nbinds;i++) NSC_STR("-B", c->binds[i]);
+#undef NSC_NUM
+#undef NSC_STR
+	v[n++] = "--";
+	v[n++] = (char*)c->root;
+	for (char **a = c->argv; (a)&&(*a); a++) v[n++] = *a;
+	v[n] = NULL;
+	return v;
+}
+
+void nsc_run(const struct nsc_config *c) {
+	static char *noargs[] = { NULL };
+	char **prog = c->argv ? c->argv : noargs;
+	int entermode = c->entermode;
+	int initmode = c->initmode;
+	int automounts = c->automounts;
+	const char *hn = c->hostname;
+	const char *old_root = c->old_root;
+	int init_timeout = c->init_timeout;
+	int use_srv = c->use_srv;
+	const char *batch = c->batch;
+	int pool_size = c->pool_size;
+	int use_pool = c->use_pool;
+	int pool_conn = -1;
+	const char *overlay = c->overlay; /* Overlay upper: a directory, or "-" for a tmpfs */
+	const char *cg_parent = c->cg_parent; /* The base cgroup */
+	const char *report = c->report;
+	char *limits[c->nlimits + 1];
+	int nlimits = c->nlimits;
+
+	int muid = getuid();
+	int mgid = getgid();
+
+	for (int i=0;i<c->nlimits;i++)
+		limits[i] = strdup(c->limits[i]);
+	if (c->tmp) tmpfs_add(strdup("/tmp"), MS_NOEXEC);
+	for (int i=0;i<c->ntmpfs;i++) tmpfs_add(strdup(c->tmpfs[i]), 0);
+	for (int i=0;i<c->nbinds;i++) bind_add(strdup(c->binds[i]));
+	if (c->capture) cap_option(strdup(c->capture));
+	cap_live = c->capture_live;
+	clean_env = c->clean_env;
+	use_filter = c->use_filter;
+	batch_jobs = c->batch_jobs;
+	trace_fd = c->trace_fd;
+	state_name = c->name;
+
+	if ((trace_fd >= 0)&&(fcntl(trace_fd, F_GETFD) < 0))
+		perror_msg_and_die("trace fd");
+	report_start = monotime_us();
+	cap_setup();
+	if ((report)&&(report[strspn(report, "0123456789")])) {
+		report_fd = open(report, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if (report_fd < 0) perror_msg_and_die2("open", report);
+	} else if (report) {
+		report_fd = atoi(report);
+		if (fcntl(report_fd, F_GETFD) < 0) perror_msg_and_die("report fd");
+	}
+	trace_mark("setup");
+
+	/* In batch mode there is no program, and we always provide init. */
+	if (batch) {
+		initmode = 1;
+		use_srv = 0;
+		if (strcmp(batch, "-") == 0) {
+			batch_fd = 0;
+		} else {
+			batch_fd = open(batch, O_RDONLY|O_CLOEXEC);
+			if (batch_fd < 0) perror_msg_and_die2("open", batch);
+		}
+	}
+
+	if ((!c->root)||((!prog[0])&&(!batch)&&(!pool_size)&&(!use_pool)))
+		error_msg_and_die("nsc_run: no root or program");
+
+	/* Automatic means we only automount if user */
+	if (automounts == 2) automounts = muid ? 1 : 0;
+
+	/* In user mode enable old_root always. */
+	if ((!old_root)&&(muid)) old_root = "oldroot";
+	/* No old root. An user can only mount /proc with a (fully visible)
+	 * proc mounted, so then the old root is detached after that. */
+	char *drop_root = NULL;
+	if ((old_root)&&(strcmp(old_root, "-") == 0))
+		old_root = drop_root = muid ? ".oldroot" : NULL;
+
+	/* An image always gets an overlay, disposable unless -o. */
+	struct image im = { .fd = -1 };
+	struct stat rst;
+	if ((stat(c->root, &rst) == 0)&&(S_ISREG(rst.st_mode))) {
+		image_open(&im, c->root);
+		if (!overlay) overlay = "-";
+	}
+
+	/* The state directory is where .pid1 and the sockets are kept. */
+	if ((overlay)&&(strcmp(overlay, "-") != 0)) {
+		if ((mkdir(overlay, 0755) != 0)&&(errno != EEXIST))
+			perror_msg_and_die2("mkdir", overlay);
+		state_dfd = open(overlay, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (state_dfd < 0) perror_msg_and_die2("open", overlay);
+		(void) mkdirat(state_dfd, "upper", 0755);
+		(void) mkdirat(state_dfd, "work", 0755);
+		overlay = realpath(overlay, NULL);
+		if (!overlay) perror_msg_and_die("realpath");
+	}
+
+	if ((im.fd < 0)&&(chdir(c->root) != 0))
+		perror_msg_and_die("chdir(dir)");
+
+	if ((im.fd < 0)&&((!overlay)||(strcmp(overlay, "-") == 0))) {
+		state_dfd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (state_dfd < 0) perror_msg_and_die("open(dir)");
+	}
+	if (state_name) {
+		if ((!*state_name)||(strchr(state_name, '/'))||(state_name[0] == '.'))
+			error_msg_and_die("Bad instance name");
+		state_base = state_base_open(muid);
+		(void) mkdirat(state_base, state_name, 0755);
+		state_dfd = openat(state_base, state_name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (state_dfd < 0) perror_msg_and_die2("open", state_name);
+	} else if ((overlay)&&(strcmp(overlay, "-") == 0)) {
+		/* A new namespace for every instance. */
+		pid1_fn = NULL;
+		entermode = 0;
+	}
+
+	/* Only the init of a live namespace can be listening on the socket. */
+	if ((use_srv)&&(entermode)) {
+		trace_mark("connect");
+		trace_mode = "srv";
+		srv_run(trace_sys(sock_connect(state_path(SOCK_FN))), prog);
+		trace_mode = "new";
+	}
+
+	if (use_pool) {
+		if (!prog[0]) pool_stats();
+		trace_mark("connect");
+		pool_run(prog);
+		/* A miss, start an anonymous namespace of our own. */
+		trace_mode = "pool-miss";
+		pid1_fn = NULL;
+		entermode = 0;
+	}
+
+	/* Run the pool, returns in the instances. */
+	if (pool_size > 0) {
+		trace_done();
+		pid1_fn = NULL;
+		initmode = 1;
+		pool_conn = pool_manager(pool_size);
+	}
+
+	/* Ask the init of the instance for its pidfd, or check for a .pid1
+	 * file in the chroot (an init that does not listen, or an old one). */
+	trace_mark("pid1");
+	int pid = 0;
+	int pidfd = pid1_fn ? trace_sys(srv_pidfd(state_dfd, &pid, (overlay)||(state_name) ? NULL : ".")) : -1;
+	int p1fd = (pid1_fn)&&(pidfd < 0) ? trace_sys(openat(state_dfd, pid1_fn, O_RDONLY)) : -1;
+	if (p1fd>=0) {
+		char buf[40+1];
+		/* Validate pid (and start time) in file... */
+		int l = 0;
+		do {
+			int r = read(p1fd, buf+l, 40-l);
+			if ((r==-1)&&(errno==EINTR)) continue;
+			if (r<=0) break;
+			l += r;
+		} while (1);
+		if (l==40) l = 0;
+		close(p1fd);
+		if (l) {
+			buf[l] = 0;
+			unsigned long long start = 0;
+			sscanf(buf, "%d %llu", &pid, &start);
+			if (pid<=0) pid = 0;
+			if (pid) pidfd = pid1_open(pid, start, (overlay)||(state_name) ? NULL : ".");
+		}
+	}
+	if ((pidfd >= 0)||(p1fd >= 0)) {
+		if ((pid)&&(pidfd != -1)) {
+			if (entermode) {
+				ns_enter(pid, pidfd, prog);
+			} else {
+				if (pidfd >= 0) {
+					syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+					close(pidfd);
+				} else {
+					kill(pid, SIGKILL);
+				}
+				fprintf(stderr, "Killed previous pid 1 (%d)\n", pid);
+			}
+			/* ns_enter does not return */
+		}
+		unlinkat(state_dfd, PID1_FN, 0);
+		unlinkat(state_dfd, SOCK_FN, 0);
+		if (entermode) fprintf(stderr, "Removed stale " PID1_FN " file\n");
+		if (entermode==1) {
+			fprintf(stderr, "Cannot enter (-E) old namespace\n");
+			exit(1);
+		}
+	}
+
+	/* Figuring out the full path and default hostname for the container. */
+	const char * path = im.fd >= 0 ? im.fn : realpath(".", NULL);
+	if (!path) perror_msg_and_die("realpath");
+
+	if (!hn) {
+		hn = strrchr(path, '/');
+		if (hn) hn = hn+1;
+		if (!hn) hn = "(container)";
+	}
+
+	if (initmode == 2) { /* Automatic mode */
+		/* If program name ends in "/init", it is init (eg. /sbin/init, or /init are.) */
+		int a0l = strlen(prog[0]);
+		if ((a0l >= 5)&&(strcmp(prog[0]+(a0l-5),"/init")==0)) initmode = 0;
+	}
+
+	/* For the start time of the init, that goes with its pid, before the
+	 * root changes. */
+	if (pid1_fn) (void) proc_open();
+
+	/* The cgroup, also before unsharing, while the files are still ours. */
+	if ((nlimits)||(cg_parent)) {
+		trace_mark("cgroup");
+		cg_setup(cg_parent, limits, nlimits, muid);
+	}
+
+	/* The fork server socket, made here since the state directory might
+	 * not be reachable from the new root. */
+	int lfd = -1;
+	if ((initmode)&&(pid1_fn)) {
+		trace_mark("listen");
+		lfd = trace_sys(srv_listen(state_path(SOCK_FN)));
+	}
+
+	/* Only do user namespaces if we have to. */
+	int more_flags = muid ? CLONE_NEWUSER : 0;
+
+	if ((im.fd >= 0)&&(muid)) {
+		trace_mark("fuse");
+		image_fuse(&im);
+	}
+
+	trace_mark("unshare");
+	if (trace_sys(unshare(CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUTS | more_flags)) != 0)
+		perror_msg_and_die("unshare");
+
+	if (muid) {
+		trace_mark("idmap");
+		procwritef("/proc/self/setgroups", "deny");
+		procwritef("/proc/self/uid_map", "0 %d 1", muid);
+		procwritef("/proc/self/gid_map", "0 %d 1", mgid);
+	}
+
+	/* slave mount. In an user ns the copied mounts already are slaves. */
+	if (!muid) {
+		trace_mark("slave");
+		if (trace_mnt(mount(NULL, "/", NULL, MS_REC|MS_SLAVE, NULL)) != 0)
+			perror_msg_and_die("slave mount");
+	}
+
+	if (im.fd >= 0) {
+		trace_mark("image");
+		image_root(&im, overlay, muid);
+	} else if (overlay) {
+		trace_mark("overlay");
+		overlay_mount(path, overlay, muid);
+	}
+
+	/* Build the new root from a detached clone of the rootfs (cheap), or
+	 * bind mount the whole thing (the old way, for older kernels). */
+	trace_mark("root");
+	int newroot = (im.fd >= 0)||(detached_root(path) == 0);
+	if (!newroot) {
+		if (trace_mnt(mount(path, path, NULL, MS_BIND|MS_REC, NULL)) != 0)
+			perror_msg_and_die("bind mount");
+
+		/* This chdir is necessary to change the current directory to the bind-mounted fs. */
+		if (chdir(path) != 0)
+			perror_msg_and_die("chdir(path)");
+	}
+
+	if (automounts) { /* for /dev and /sys */
+		trace_mark("automounts");
+		/* These will fail if /dev and/or sys are correct already. */
+		unlink("dev"); rmdir("dev");
+		unlink("sys"); rmdir("sys");
+
+		if ((muid)&&(!drop_root)) {
+			/* User mode, /dev and /sys symlinks. */
+			char *ds = strdcat(old_root,"/dev");
+			char *ss = strdcat(old_root,"/sys");
+			if (trace_sys(symlink(ds, "dev")) != 0) perror("dev symlink");
+			if (trace_sys(symlink(ss, "sys")) != 0) perror("sys symlink");
+			free(ds);
+			free(ss);
+		} else {
+			/* Superuser mode (or no old root), bind mounts. An user
+			 * can only bind the whole of /sys, with the mounts in it. */
+			mkdir("dev", 0755);
+			mkdir("sys", 0755);
+			if (trace_mnt(mount("/dev", "dev", NULL, MS_BIND|MS_REC, NULL)) != 0)
+				perror("mount /dev");
+			if (trace_mnt(mount("/sys", "sys", NULL, MS_BIND|(muid ? MS_REC : 0), NULL)) != 0)
+				perror("mount /sys");
+		}
+	}
+
+	if (nbinds) {
+		trace_mark("binds");
+		bind_mount();
+	}
+
+	if (old_root) {
+		/* Make the old rootfs visible. We need them later, and as an user we cant unmount them either.  */
+		(void) mkdir(old_root, 0755);
+	}
+
+	if (newroot) {
+		/* pivot_root moves the old root tree instead of copying it. Without
+		 * old_root, pivot on top of ourselves and detach all of it at once. */
+		trace_mark("pivot");
+		if (trace_mnt(syscall(SYS_pivot_root, ".", old_root ? old_root : ".")) != 0)
+			perror_msg_and_die("pivot_root");
+		if ((!old_root)&&(trace_mnt(umount2(".", MNT_DETACH)) != 0))
+			perror_msg_and_die("umount(old root)");
+	} else {
+		trace_mark("umountizer");
+		if (old_root) {
+			if (trace_mnt(mount("/", old_root, NULL, MS_BIND|MS_REC, NULL)) != 0)
+				perror("oldroot move");
+		}
+
+		umountizer(path);
+
+		trace_mark("move");
+		if (trace_mnt(mount(path, "/", NULL, MS_MOVE, NULL)) != 0)
+			perror_msg_and_die("move mount");
+	}
+
+	trace_mark("chroot");
+	if (chroot(".") != 0)
+		perror_msg_and_die("chroot(.)");
+
+	if (chdir("/") != 0)
+		perror_msg_and_die("chdir(/)");
+
+
+
+	int pifd[2];
+	if (initmode) if (pipe(pifd) != 0) perror_msg_and_die("pipe");
+
+	/* We need to f**k it to be in the new pid namespace. */
+	trace_mark("fork");
+	pid_t chld = trace_sys(fork());
+	if (chld == -1) perror_msg_and_die("fork");
+
+	if (chld) {
+		trace_done();
+		if (lfd >= 0) close(lfd);
+		/* Store the child pid for other entries into the "chroot". */
+		if (pid1_fn) writelinef(state_dfd, pid1_fn, "%d %llu", chld, proc_starttime(chld));
+		if (state_name) {
+			char info[PATH_MAX+1024];
+			char **args = nsc_args(c);
+			int l = snprintf(info, sizeof(info), "%lld\t%s\t", (long long)time(NULL), path);
+			for (int i=1;(args)&&(args[i])&&(l<sizeof(info));i++)
+				l += snprintf(info+l, sizeof(info)-l, "%s%s", i>1 ? " " : "", args[i]);
+			free(args);
+			if (pwritef(state_dfd, INFO_FN, info, O_CREAT|O_TRUNC) != 0) perror("write " INFO_FN);
+		}
+		uint8_t retval = 0;
+
+		if (initmode) {
+			/* We quit when the program launched by init quits. */
+			/* If the program launches daemons or other programs
+			 * join the namespace in the meantime, the init gets
+			 * left behind to take care of them, and quits when
+			 * there are no more processes in the namespace. */
+			struct report_msg m = { 0 };
+			int r;
+			close(pifd[1]);
+			cap_run(pifd[0]);
+			do {
+				r = read(pifd[0], &m, report_fd >= 0 ? sizeof(m) : 1);
+			} while ((r==-1)&&(errno==EINTR));
+			if (r == sizeof(m)) report_write(&m);
+			retval = m.retval;
+		} else {
+			/* I suppose we need to wait for the child. */
+			cap_run(syscall(SYS_pidfd_open, chld, 0));
+			retval = wait_report(chld);
+			cg_cleanup();
+			/* Child is gone, remove pidfile. */
+			state_drop(state_dfd, -1);
+
+		}
+		exit(retval);
+	}
+	if (initmode) close(pifd[0]);
+	cap_child();
+	if (!initmode) cap_stdio(1);
+	cg_join(initmode ? "init" : "jobs");
+
+	/* We are basically in the environment we need, on the rest
+	 * of things just report errors instead of aborting on error */
+
+	if (automounts) { /* for /proc, since needs to be in new pid ns. */
+		trace_mark("proc");
+		(void) mkdir("proc", 0755);
+		if (trace_mnt(mount("proc", "/proc", "proc", MS_NOEXEC|MS_NOSUID|MS_NODEV, NULL)) != 0)
+			perror("mount /proc");
+
+	}
+
+	if (drop_root) {
+		if (trace_mnt(umount2(drop_root, MNT_DETACH)) != 0)
+			perror("umount(old root)");
+		(void) rmdir(drop_root);
+	}
+
+	if (ntmpfs) {
+		trace_mark("tmpfs");
+		tmpfs_mount();
+	}
+
+	trace_mark("hostname");
+	if (trace_sys(sethostname(hn, strlen(hn))) != 0)
+		perror("sethostname");
+
+	if (pool_conn >= 0) {
+		/* A pool instance: wait for (just) the one program to run. */
+		sigset_t chld;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &chld, NULL);
+		cap_stdio(0);
+		init_loop(-1, pifd[1], -1, pool_conn, 0);
+	}
+
+	if (initmode) {
+		/* We need to become init for the program we are about to run,
+		 * and any others that join the namespace later. */
+		sigset_t chld, omask;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &chld, &omask);
+		trace_mark("init");
+		pid_t prog = trace_sys(fork());
+		if (prog == -1) perror_msg_and_die("fork");
+		if (prog) {
+			trace_done();
+			cap_stdio(0);
+			init_loop(prog, pifd[1], lfd, -1, init_timeout); /* We are init. */
+		}
+		close(pifd[1]); /* Dont leak the pipe write fd to the program. */
+		cap_stdio(1);
+		cg_join("jobs");
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+	}
+
+	if (batch_fd >= 0) {
+		trace_dump();
+		exit(batch_run());
+	}
+	run_prog(prog);
+}
+
+/* The child of nsc_launch(), on the memory of the caller until it execs. */
+struct nsc_spawn {
+	char **argv;
+	sigset_t mask;
+	int err;
+};
+
+static int nsc_exec(void *a) {
+	struct nsc_spawn *s = a;
+	/* The handlers are our own (no CLONE_SIGHAND), and must not run here. */
+	for (int i=1;i<_NSIG;i++) {
+		struct sigaction sa;
+		if ((sigaction(i, NULL, &sa) == 0)&&(sa.sa_handler != SIG_IGN)&&(sa.sa_handler != SIG_DFL)) {
+			sa.sa_handler = SIG_DFL;
+			sigaction(i, &sa, NULL);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &s->mask, NULL);
+	execvp(s->argv[0], s->argv);
+	s->err = errno;
+	_exit(127);
+}
+
+int nsc_launch(const struct nsc_config *c, pid_t *pid) {
+	struct nsc_spawn s = { .argv = nsc_args(c) };
+	const size_t ss = 64 << 10;
+	char *stack = malloc(ss);
+	int pidfd = -1;
+	sigset_t all;
+	if ((!s.argv)||(!stack)) {
+		free(s.argv);
+		free(stack);
+		errno = ENOMEM;
+		return -1;
+	}
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &s.mask);
+	pid_t p = clone(nsc_exec, stack + ss, CLONE_VM|CLONE_VFORK|CLONE_PIDFD|SIGCHLD, &s, &pidfd);
+	if ((p < 0)&&(errno == EINVAL)) { /* No CLONE_PIDFD before 5.2 */
+		p = clone(nsc_exec, stack + ss, CLONE_VM|CLONE_VFORK|SIGCHLD, &s);
+		if (p > 0) pidfd = syscall(SYS_pidfd_open, p, 0);
+	}
+	int err = errno;
+	sigprocmask(SIG_SETMASK, &s.mask, NULL);
+	free(stack);
+	free(s.argv);
+	if (p < 0) {
+		errno = err;
+		return -1;
+	}
+	if (s.err) {
+		while ((waitpid(p, NULL, 0) < 0)&&(errno == EINTR));
+		if (pidfd >= 0) close(pidfd);
+		errno = s.err;
+		return -1;
+	}
+	if (pid) *pid = p;
+	return pidfd;
+}
+
+int nsc_enter(const struct nsc_config *c, pid_t *pid) {
+	struct nsc_config e = *c;
+	e.entermode = 1;
+	return nsc_launch(&e, pid);
+}
+
+int nsc_wait(int pidfd) {
+	siginfo_t si;
+	while (waitid(P_PIDFD, pidfd, &si, WEXITED) != 0)
+		if (errno != EINTR) return -1;
+	if (si.si_code == CLD_EXITED) return si.si_status;
+	return 128 + si.si_status;
+}
+
+int nsc_kill(int pidfd, int sig) {
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
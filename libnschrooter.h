@@ -0,0 +1,73 @@
+/* See LICENSE. */
+
+/* libnschrooter: what the nschrooter command does, for programs that
+ * launch a lot of instances. nsc_run() is the setup sequence itself (the
+ * command is a getopt wrapper over it), and nsc_launch()/nsc_enter() run
+ * it in a new process without forking the caller: a vfork style clone
+ * (CLONE_VM|CLONE_VFORK|CLONE_PIDFD) that execs the nschrooter command,
+ * so a large caller pays for neither a copy of its address space nor
+ * the page table copy of a fork. They return a pidfd, for poll(),
+ * nsc_wait() and nsc_kill(). Errors are -1 and errno, except in
+ * nsc_run(), which (like the command) reports and exits. */
+
+#ifndef LIBNSCHROOTER_H
+#define LIBNSCHROOTER_H
+
+#include <sys/types.h>
+
+struct nsc_config {
+	const char *root; /* The rootfs directory (or image) */
+	char **argv; /* The program, NULL terminated (NULL for pools and batches) */
+	int initmode; /* 0 = the program is init, 1 = we are its init, 2 = automatic (-b/-i) */
+	int entermode; /* 0 = new namespace, 1 = enter the old one, 2 = automatic (-k/-E) */
+	int automounts; /* /proc, /dev and /sys: 0 = no, 1 = yes, 2 = if user (-N/-A) */
+	int use_srv; /* -S */
+	int use_pool; /* -p */
+	int pool_size; /* -P */
+	int clean_env; /* -c */
+	int use_filter; /* -F */
+	int init_timeout; /* -t, default 5 */
+	int batch_jobs; /* -j, default 1 */
+	int trace_fd; /* -x, default -1 */
+	int tmp; /* -T */
+	int capture_live; /* -V */
+	const char *hostname; /* -M */
+	const char *old_root; /* -r */
+	const char *overlay; /* -o dir, or "-" for -O */
+	const char *name; /* -n */
+	const char *batch; /* -m */
+	const char *cg_parent; /* -G */
+	const char *capture; /* -C */
+	const char *report; /* -R */
+	char **limits; /* -L */
+	int nlimits;
+	char **tmpfs; /* -W */
+	int ntmpfs;
+	char **binds; /* -B */
+	int nbinds;
+	const char *helper; /* The nschrooter command for nsc_launch(), default from PATH */
+};
+
+/* The defaults of the command. */
+void nsc_config_init(struct nsc_config *c);
+
+/* The config as nschrooter arguments (malloc()ed, NULL terminated). */
+char **nsc_args(const struct nsc_config *c);
+
+/* Set up and run the instance in this process. Does not return. */
+void nsc_run(const struct nsc_config *c) __attribute__((noreturn));
+
+/* Start an instance (nsc_enter: in the old namespace, as -E). Returns a
+ * pidfd of the process, and its pid in *pid if pid is not NULL. */
+int nsc_launch(const struct nsc_config *c, pid_t *pid);
+int nsc_enter(const struct nsc_config *c, pid_t *pid);
+
+/* Wait for it to exit, returns the exit status (128+n for signal n). */
+int nsc_wait(int pidfd);
+
+int nsc_kill(int pidfd, int sig);
+
+/* Print the named instances that are up (as -l). */
+void nsc_list(void);
+
+#endif
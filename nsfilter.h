@@ -0,0 +1,124 @@
+/* See LICENSE. */
+
+/* The default unsfilter rules (chown and set*id return success without
+ * doing anything) as a BPF program put together at build time, for
+ * nschrooter and nssu to install just before exec without libseccomp.
+ * Like the libseccomp one, this kills on a foreign (or x32) syscall. */
+
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#if defined(__x86_64__)
+#define NSF_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define NSF_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define NSF_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__) && !defined(__ARMEB__)
+#define NSF_ARCH AUDIT_ARCH_ARM
+#elif defined(__riscv) && (__riscv_xlen == 64)
+#define NSF_ARCH AUDIT_ARCH_RISCV64
+#endif
+
+#ifdef NSF_ARCH
+
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS SECCOMP_RET_KILL
+#endif
+
+/* Two instructions per syscall, so that the ones missing on an arch
+ * dont change any jump offsets. */
+#define NSF_IGNORE(nr) \
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, (nr), 0, 1), \
+	BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_ERRNO|0)
+
+static const struct sock_filter nsfilter_prog[] = {
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct seccomp_data, arch)),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, NSF_ARCH, 1, 0),
+	BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_KILL_PROCESS),
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, offsetof(struct seccomp_data, nr)),
+#ifdef __x86_64__
+	/* x32 has the same arch, but other syscall numbers. */
+	BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, 0x40000000, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_KILL_PROCESS),
+#endif
+	/* chown */
+#ifdef SYS_chown
+	NSF_IGNORE(SYS_chown),
+#endif
+#ifdef SYS_chown32
+	NSF_IGNORE(SYS_chown32),
+#endif
+	NSF_IGNORE(SYS_fchown),
+#ifdef SYS_fchown32
+	NSF_IGNORE(SYS_fchown32),
+#endif
+	NSF_IGNORE(SYS_fchownat),
+#ifdef SYS_lchown
+	NSF_IGNORE(SYS_lchown),
+#endif
+#ifdef SYS_lchown32
+	NSF_IGNORE(SYS_lchown32),
+#endif
+	/* set*id, etc. Change of groups or user/fs/etc ids... */
+	NSF_IGNORE(SYS_setfsgid),
+#ifdef SYS_setfsgid32
+	NSF_IGNORE(SYS_setfsgid32),
+#endif
+	NSF_IGNORE(SYS_setfsuid),
+#ifdef SYS_setfsuid32
+	NSF_IGNORE(SYS_setfsuid32),
+#endif
+	NSF_IGNORE(SYS_setgid),
+#ifdef SYS_setgid32
+	NSF_IGNORE(SYS_setgid32),
+#endif
+	NSF_IGNORE(SYS_setgroups),
+#ifdef SYS_setgroups32
+	NSF_IGNORE(SYS_setgroups32),
+#endif
+	NSF_IGNORE(SYS_setregid),
+#ifdef SYS_setregid32
+	NSF_IGNORE(SYS_setregid32),
+#endif
+	NSF_IGNORE(SYS_setresgid),
+#ifdef SYS_setresgid32
+	NSF_IGNORE(SYS_setresgid32),
+#endif
+	NSF_IGNORE(SYS_setresuid),
+#ifdef SYS_setresuid32
+	NSF_IGNORE(SYS_setresuid32),
+#endif
+	NSF_IGNORE(SYS_setreuid),
+#ifdef SYS_setreuid32
+	NSF_IGNORE(SYS_setreuid32),
+#endif
+	NSF_IGNORE(SYS_setuid),
+#ifdef SYS_setuid32
+	NSF_IGNORE(SYS_setuid32),
+#endif
+	BPF_STMT(BPF_RET|BPF_K, SECCOMP_RET_ALLOW)
+};
+
+/* Install the filter on ourselves. Returns -1 (errno set) on failure. */
+static int nsfilter_apply(void) {
+	struct sock_fprog p = {
+		.len = sizeof(nsfilter_prog) / sizeof(nsfilter_prog[0]),
+		.filter = (struct sock_filter*)nsfilter_prog
+	};
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) return -1;
+	return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &p, 0, 0);
+}
+
+#else
+
+static int nsfilter_apply(void) {
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
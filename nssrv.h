@@ -0,0 +1,180 @@
+/* See LICENSE. */
+
+/* The fork server protocol, of the nschrooter init (-S) and the nssu
+ * identity server (-D): a SOCK_SEQPACKET unix socket, where a request is
+ * a single packet of a header (the caller's, starting with the string
+ * counts), some fds of the client (SCM_RIGHTS), and then the strings,
+ * NUL terminated. After that the client may send single bytes of signals
+ * to pass on to the program, and it gets the exit status back.
+ * The includer provides perror_msg_and_die(). */
+
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+static void perror_msg_and_die(const char* msg);
+
+static int sock_connect(const char *fn) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	if (strlen(fn) >= sizeof(sa.sun_path)) return -1;
+	strcpy(sa.sun_path, fn);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Listen for requests on the socket fn (only for us, 0600). */
+static int srv_listen(const char *fn) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	if (strlen(fn) >= sizeof(sa.sun_path)) return -1;
+	strcpy(sa.sun_path, fn);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (fd < 0) return -1;
+	unlink(sa.sun_path);
+	mode_t um = umask(0077);
+	int r = bind(fd, (struct sockaddr*)&sa, sizeof(sa));
+	umask(um);
+	if ((r != 0)||(listen(fd, 64) != 0)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Send the request: header h (hl bytes), then the strings of the ns NULL
+ * terminated lists in strs, with the nfds fds. */
+static int srv_send(int fd, const void *h, size_t hl, char **strs[], int ns, const int *fds, int nfds) {
+	size_t len = hl;
+	for (int i=0;i<ns;i++)
+		for (char **s=strs[i];*s;s++) len += strlen(*s) + 1;
+	char *buf = malloc(len);
+	if (!buf) perror_msg_and_die("malloc");
+	memcpy(buf, h, hl);
+	char *p = buf + hl;
+	for (int i=0;i<ns;i++)
+		for (char **s=strs[i];*s;s++) p = stpcpy(p, *s) + 1;
+
+	char cbuf[CMSG_SPACE(sizeof(int) * nfds)];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = nfds ? cbuf : NULL, .msg_controllen = nfds ? sizeof(cbuf) : 0 };
+	if (nfds) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+	int r = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	free(buf);
+	return r < 0 ? -1 : 0;
+}
+
+/* Receive a request of at least hl bytes into *buf (malloc()ed, NUL
+ * terminated), and the fds into fds (those not sent stay as they are).
+ * Returns the length, or -1. */
+static ssize_t srv_recv(int conn, size_t hl, int *fds, int nfds, char **buf) {
+	ssize_t len = recv(conn, NULL, 0, MSG_PEEK|MSG_TRUNC);
+	if (len < (ssize_t)hl) return -1;
+	*buf = malloc(len + 1);
+	if (!*buf) return -1;
+	char cbuf[CMSG_SPACE(sizeof(int) * nfds)];
+	struct iovec iov = { .iov_base = *buf, .iov_len = len };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	ssize_t r = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	if ((cm)&&(cm->cmsg_type == SCM_RIGHTS)&&(cm->cmsg_len == CMSG_LEN(sizeof(int) * nfds)))
+		memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfds);
+	if (r != len) {
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	(*buf)[len] = 0;
+	return len;
+}
+
+/* Split the strings after the header (at hl) of a request of len bytes
+ * into a vector of the ng groups of counts[i] strings, each followed by a
+ * NULL. All of them must be there. Returns it (malloc()ed) or NULL. */
+static char **srv_split(char *buf, ssize_t len, size_t hl, const uint32_t *counts, int ng) {
+	size_t n = ng;
+	for (int g=0;g<ng;g++) {
+		if (counts[g] > len) return NULL;
+		n += counts[g];
+	}
+	char **v = calloc(n, sizeof(char*));
+	if (!v) return NULL;
+	char *p = buf + hl;
+	char **o = v;
+	for (int g=0;g<ng;g++,o++) {
+		for (uint32_t i=0;i<counts[g];i++) {
+			if (p >= buf + len) {
+				free(v);
+				return NULL;
+			}
+			*o++ = p;
+			p += strlen(p) + 1;
+		}
+	}
+	return v;
+}
+
+/* The client side: pass on the signals one would send to the program in
+ * the foreground. */
+static int srv_fd = -1;
+static void srv_sig(int sig) {
+	uint8_t b = sig;
+	(void) send(srv_fd, &b, 1, MSG_NOSIGNAL);
+}
+
+static void srv_forward(int fd) {
+	srv_fd = fd;
+	struct sigaction sa_sig = { .sa_handler = srv_sig };
+	sigaction(SIGINT, &sa_sig, NULL);
+	sigaction(SIGTERM, &sa_sig, NULL);
+	sigaction(SIGHUP, &sa_sig, NULL);
+	sigaction(SIGQUIT, &sa_sig, NULL);
+}
+
+/* What an epoll event is about, the fd is in the low 32 bits. From 4 up
+ * they are the includer's own. */
+#define EV_SIG    (1ULL << 32)
+#define EV_LISTEN (2ULL << 32)
+#define EV_CONN   (3ULL << 32)
+
+static void ep_add(int ep, int fd, uint64_t type) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = type | (uint32_t)fd };
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0)
+		perror_msg_and_die("epoll_ctl");
+}
+
+static void ep_close(int ep, int fd) {
+	epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+/* Accept the clients waiting on lfd into ep (as EV_CONN), if they are us
+ * (from any of our namespaces). Returns how many. */
+static int srv_accept(int lfd, int ep) {
+	int c, n = 0;
+	while ((c = accept4(lfd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) >= 0) {
+		struct ucred uc;
+		socklen_t ul = sizeof(uc);
+		if ((getsockopt(c, SOL_SOCKET, SO_PEERCRED, &uc, &ul) != 0)||(uc.uid != getuid())) {
+			close(c);
+			continue;
+		}
+		ep_add(ep, c, EV_CONN);
+		n++;
+	}
+	return n;
+}
@@ -13,6 +13,16 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <pwd.h>
+#include <grp.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include "nsfilter.h"
+#include "nssrv.h"
 
 static void perror_msg_and_die2(const char* msg, const char *extra) {
 	if (extra) fprintf(stderr,"%s: ", extra);
@@ -53,26 +63,560 @@ static void procwritef(const char * fn, const char *msg, ...) {
 /* Make new malloc() string c = a + b */
 static char* strdcat(const char *a, const char *b) {
 	size_t la = strlen(a);
-	char* c = malloc(la+strlen(b));
+	char* c = malloc(la+strlen(b)+1);
 	if (!c) perror_msg_and_die("malloc");
 	memcpy(c,a,la);
 	strcpy(c+la,b);
 	return c;
 }
 
+/* Generate a return value from a wait() status variable. */
+static uint8_t wait_retval(int status) {
+	if (WIFEXITED(status)) return WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) return WTERMSIG(status)+128;
+	return 255;
+}
+
+/* The identity server (-D sock): a long-lived nssu that keeps one user
+ * namespace per target uid/gid, all of them children of its own, and
+ * runs the programs for the nssu clients (that find it by $NSSU_SOCK) in
+ * them. So switching back and forth doesnt nest namespaces, and a switch
+ * to a known identity is just a setns.
+ * A request (see nssrv.h) is this header, the stdin/out/err and cwd fds
+ * of the client, and then the file to run, argv and envp. The exit status
+ * comes back as one byte. */
+struct srv_req {
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t filter; /* use_filter */
+	uint32_t uid;
+	uint32_t gid;
+};
+
+#define SRV_NFDS 4
+
+/* Have the server at the other end of fd run file as uid/gid. Doesnt
+ * return if it did, returns (and closes fd) if that cant be done. */
+static void srv_run(int fd, const char *file, char **argv, int uid, int gid, int filter) {
+	if (fd < 0) return;
+	struct srv_req h = { 0, 0, filter, uid, gid };
+	while (argv[h.argc]) h.argc++;
+	while (environ[h.envc]) h.envc++;
+	char *fv[2] = { (char*)file, NULL };
+	char **strs[3] = { fv, argv, environ };
+	int fds[SRV_NFDS] = { 0, 1, 2, open(".", O_PATH|O_DIRECTORY|O_CLOEXEC) };
+	if (fds[3] < 0) perror_msg_and_die("open(.)");
+	int r = srv_send(fd, &h, sizeof(h), strs, 3, fds, SRV_NFDS);
+	close(fds[3]);
+	if (r != 0) {
+		close(fd);
+		return;
+	}
+	srv_forward(fd);
+
+	uint8_t retval = 0;
+	do {
+		r = recv(fd, &retval, 1, 0);
+	} while ((r==-1)&&(errno==EINTR));
+	if (r != 1) error_msg_and_die("Lost the identity server");
+	exit(retval);
+}
+
+/* The cached namespaces, by target identity. */
+struct srv_ns {
+	uint32_t uid, gid;
+	int fd;
+};
+
+static struct srv_ns *nss = NULL;
+static int nnss = 0;
+
+/* The user namespace fd for uid/gid: made on the first use by a child
+ * that unshares and maps itself, and passes back /proc/self/ns/user. */
+static int srv_userns(uint32_t uid, uint32_t gid) {
+	for (int i=0;i<nnss;i++)
+		if ((nss[i].uid == uid)&&(nss[i].gid == gid)) return nss[i].fd;
+	int muid = getuid(), mgid = getgid();
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sp) != 0) return -1;
+	pid_t pid = fork();
+	if (pid == -1) {
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+	if (!pid) {
+		if (unshare(CLONE_NEWUSER) != 0) _exit(1);
+		procwritef("/proc/self/setgroups", "deny");
+		procwritef("/proc/self/uid_map", "%u %d 1", uid, muid);
+		procwritef("/proc/self/gid_map", "%u %d 1", gid, mgid);
+		int nfd = open("/proc/self/ns/user", O_RDONLY);
+		if (nfd < 0) _exit(1);
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { .iov_base = "N", .iov_len = 1 };
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &nfd, sizeof(int));
+		_exit(sendmsg(sp[1], &mh, 0) != 1);
+	}
+	close(sp[1]);
+	int nfd = -1;
+	char b, cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &b, .iov_len = 1 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	if (recvmsg(sp[0], &mh, MSG_CMSG_CLOEXEC) == 1) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if ((cm)&&(cm->cmsg_type == SCM_RIGHTS))
+			memcpy(&nfd, CMSG_DATA(cm), sizeof(int));
+	}
+	close(sp[0]);
+	waitpid(pid, NULL, 0);
+	if (nfd < 0) return -1;
+	nss = realloc(nss, (nnss + 1) * sizeof(*nss));
+	if (!nss) perror_msg_and_die("(re)alloc");
+	nss[nnss].uid = uid;
+	nss[nnss].gid = gid;
+	nss[nnss].fd = nfd;
+	nnss++;
+	return nfd;
+}
+
+/* Read a request from conn and fork off the program for it. */
+static pid_t srv_spawn(int conn) {
+	int fds[SRV_NFDS] = { -1, -1, -1, -1 };
+	char *buf = NULL;
+	pid_t pid = -1;
+	ssize_t len = srv_recv(conn, sizeof(struct srv_req), fds, SRV_NFDS, &buf);
+	if (len < 0) goto out;
+
+	/* The file, argv and envp. */
+	struct srv_req h;
+	memcpy(&h, buf, sizeof(h));
+	if (h.argc < 1) goto out;
+	uint32_t counts[3] = { 1, h.argc, h.envc };
+	char **v = srv_split(buf, len, sizeof(h), counts, 3);
+	if (!v) goto out;
+
+	/* Our own identity needs no namespace of its own. */
+	int nfd = -1;
+	if ((h.uid != getuid())||(h.gid != getgid())) {
+		nfd = srv_userns(h.uid, h.gid);
+		if (nfd < 0) {
+			free(v);
+			goto out;
+		}
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		sigset_t chld;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &chld, NULL);
+		/* Away from our terminal, if any, so it can read theirs. */
+		setsid();
+		for (int i=0;i<3;i++)
+			if ((fds[i] >= 0)&&(dup2(fds[i], i) != i)) _exit(127);
+		if ((fds[3] >= 0)&&(fchdir(fds[3]) != 0)) perror("fchdir");
+		if ((nfd >= 0)&&(setns(nfd, CLONE_NEWUSER) != 0)) {
+			perror("setns");
+			_exit(127);
+		}
+		if ((h.filter)&&(nsfilter_apply() != 0)) {
+			perror("seccomp filter");
+			_exit(127);
+		}
+		environ = v + 2 + h.argc + 1;
+		execvp(v[0], v + 2);
+		perror("execvp");
+		_exit(127);
+	}
+	free(v);
+out:
+	for (int i=0;i<SRV_NFDS;i++) if (fds[i] >= 0) close(fds[i]);
+	free(buf);
+	return pid;
+}
+
+struct srv_job {
+	pid_t pid;
+	int conn;
+};
+
+/* Serve on the socket fn until SIGTERM/SIGINT. Does not return. */
+static void srv_serve(const char *fn) {
+	int lfd = srv_listen(fn);
+	if (lfd < 0) perror_msg_and_die2("listen", fn);
+
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	int sfd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) perror_msg_and_die("signalfd");
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) perror_msg_and_die("epoll_create1");
+	ep_add(ep, sfd, EV_SIG);
+	ep_add(ep, lfd, EV_LISTEN);
+
+	struct srv_job *jobs = NULL;
+	int njobs = 0;
+	do {
+		struct epoll_event evs[16];
+		int n = epoll_wait(ep, evs, 16, -1);
+		for (int i=0;i<n;i++) {
+			int fd = (uint32_t)evs[i].data.u64;
+			uint64_t type = evs[i].data.u64 & ~0xFFFFFFFFULL;
+			if (type == EV_SIG) {
+				struct signalfd_siginfo si;
+				while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+					if ((si.ssi_signo == SIGTERM)||(si.ssi_signo == SIGINT)) {
+						unlink(fn);
+						exit(0);
+					}
+				}
+				int s;
+				pid_t r;
+				while ((r = waitpid(-1, &s, WNOHANG)) > 0) {
+					uint8_t retval[1] = { wait_retval(s) };
+					for (int j=0;j<njobs;j++) {
+						if (jobs[j].pid != r) continue;
+						if (jobs[j].conn >= 0) {
+							(void) send(jobs[j].conn, retval, 1, MSG_NOSIGNAL);
+							ep_close(ep, jobs[j].conn);
+						}
+						jobs[j] = jobs[--njobs];
+						break;
+					}
+				}
+			} else if (type == EV_LISTEN) {
+				(void) srv_accept(lfd, ep);
+			} else if (type == EV_CONN) {
+				int j;
+				for (j=0;j<njobs;j++) if (jobs[j].conn == fd) break;
+				if (j == njobs) {
+					/* The request. */
+					pid_t pid = srv_spawn(fd);
+					if (pid < 0) {
+						ep_close(ep, fd);
+						continue;
+					}
+					jobs = realloc(jobs, (njobs + 1) * sizeof(*jobs));
+					if (!jobs) perror_msg_and_die("(re)alloc");
+					jobs[njobs].pid = pid;
+					jobs[njobs].conn = fd;
+					njobs++;
+					continue;
+				}
+				/* Signals for the program, or the client went away. */
+				uint8_t sig;
+				int x = recv(fd, &sig, 1, 0);
+				if ((x == -1)&&(errno == EAGAIN)) continue;
+				if (x == 1) {
+					kill(jobs[j].pid, sig);
+					continue;
+				}
+				kill(jobs[j].pid, SIGHUP);
+				ep_close(ep, fd);
+				jobs[j].conn = -1;
+			}
+		}
+	} while (1);
+}
+
+/* The passwd/group index: /etc/passwd and /etc/group parsed into hash
+ * tables by name, kept in $XDG_CACHE_HOME/nssu (or ~/.cache/nssu) and
+ * mmap()ed by later runs, as long as the files are the same (by dev, ino,
+ * size and mtime). One index per passwd file, so chroots dont mix.
+ * The layout: header, user buckets, group buckets, users, groups and
+ * strings. The buckets and chains are entry index+1, 0 ends. */
+#define PWI_MAGIC "nssupwi1"
+
+struct pwi_src {
+	uint64_t dev, ino, size;
+	int64_t mtime;
+};
+
+struct pwi_hdr {
+	char magic[8];
+	struct pwi_src src[2];
+	uint32_t nu, ng, nb, slen;
+};
+
+struct pwi_ent {
+	uint32_t name, id, gid, dir, shell, next;
+};
+
+static const char *pwi = NULL;
+
+/* FNV-1a, for the names and to name the index. */
+static uint64_t fnv1a(uint64_t h, const void *p, size_t l) {
+	const unsigned char *b = p;
+	for (size_t i=0;i<l;i++) {
+		h ^= b[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void pwi_stat(int fd, struct pwi_src *s) {
+	struct stat st;
+	memset(s, 0, sizeof(*s));
+	if ((fd < 0)||(fstat(fd, &st) != 0)) return;
+	s->dev = st.st_dev;
+	s->ino = st.st_ino;
+	s->size = st.st_size;
+	s->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static char *pfdreader(int fd) {
+	int ml = 1;
+	char *buf = NULL;
+	int o = 0;
+	do {
+		if ((ml-o-1) < 2048) {
+			ml += 4096;
+			buf = realloc(buf, ml);
+			if (!buf) perror_msg_and_die("(re)alloc");
+		}
+		if (fd < 0) break;
+		int r = read(fd, buf+o, ml-o-1);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r<=0) break;
+		o += r;
+	} while (1);
+	buf[o] = 0;
+	return buf;
+}
+
+/* Parse one of the files into entries at e (NULL to just count them),
+ * with the strings appended at str. Passwd lines are
+ * name:pw:uid:gid:gecos:dir:shell, group lines name:pw:gid:members. */
+static uint32_t pwi_parse(char *f, int grp, struct pwi_ent *e, char *str, uint32_t *slen) {
+	uint32_t n = 0;
+	char *nl;
+	for (char *l = f; l; l = nl) {
+		nl = strchr(l, '\n');
+		if (nl) *nl++ = 0;
+		char *fl[7];
+		int nf = 0;
+		for (char *p = l; (p)&&(nf < 7); nf++) {
+			fl[nf] = p;
+			p = strchr(p, ':');
+			if (p) *p++ = 0;
+		}
+		int ok = (nf >= (grp ? 3 : 7))&&(*fl[0])&&(*fl[0] != '+')&&(*fl[0] != '-');
+		if ((ok)&&(e)) {
+			e[n].name = *slen;
+			*slen = stpcpy(str + *slen, fl[0]) - str + 1;
+			e[n].id = strtoul(fl[2], NULL, 10);
+			if (!grp) {
+				e[n].gid = strtoul(fl[3], NULL, 10);
+				e[n].dir = *slen;
+				*slen = stpcpy(str + *slen, fl[5]) - str + 1;
+				e[n].shell = *slen;
+				*slen = stpcpy(str + *slen, fl[6]) - str + 1;
+			}
+		}
+		if (!e) {
+			/* Put the separators back for the second pass. */
+			for (int i=1;i<nf;i++) fl[i][-1] = ':';
+			if (nl) nl[-1] = '\n';
+		}
+		n += ok;
+	}
+	return n;
+}
+
+/* Build the index from the files (fd -1 = none). Returns its size. */
+static size_t pwi_build(int pfd, int gfd, struct pwi_src src[2], char **out) {
+	char *f[2] = { pfdreader(pfd), pfdreader(gfd) };
+	struct pwi_hdr h = { PWI_MAGIC };
+	memcpy(h.src, src, sizeof(h.src));
+	h.nu = pwi_parse(f[0], 0, NULL, NULL, NULL);
+	h.ng = pwi_parse(f[1], 1, NULL, NULL, NULL);
+	h.nb = 16;
+	while ((h.nb < h.nu * 2)||(h.nb < h.ng * 2)) h.nb *= 2;
+	size_t tl = strlen(f[0]) + strlen(f[1]) + 1;
+	size_t len = sizeof(h) + h.nb * 2 * sizeof(uint32_t) + (h.nu + h.ng) * sizeof(struct pwi_ent) + tl;
+	char *b = calloc(1, len);
+	if (!b) perror_msg_and_die("calloc");
+	uint32_t *ub = (uint32_t*)(b + sizeof(h));
+	uint32_t *gb = ub + h.nb;
+	struct pwi_ent *ue = (struct pwi_ent*)(gb + h.nb);
+	struct pwi_ent *ge = ue + h.nu;
+	char *str = (char*)(ge + h.ng);
+	uint32_t slen = 1; /* 0 is "" */
+	pwi_parse(f[0], 0, ue, str, &slen);
+	pwi_parse(f[1], 1, ge, str, &slen);
+	/* Chain them up backwards, so that the first of a name is found first. */
+	for (int i=h.nu;i--;) {
+		uint32_t k = fnv1a(0xcbf29ce484222325ULL, str + ue[i].name, strlen(str + ue[i].name)) & (h.nb-1);
+		ue[i].next = ub[k];
+		ub[k] = i + 1;
+	}
+	for (int i=h.ng;i--;) {
+		uint32_t k = fnv1a(0xcbf29ce484222325ULL, str + ge[i].name, strlen(str + ge[i].name)) & (h.nb-1);
+		ge[i].next = gb[k];
+		gb[k] = i + 1;
+	}
+	h.slen = slen;
+	memcpy(b, &h, sizeof(h));
+	free(f[0]);
+	free(f[1]);
+	*out = b;
+	return len - tl + slen;
+}
+
+/* Is the index at b (of len bytes) in one piece, and for these files. */
+static int pwi_valid(const char *b, size_t len, struct pwi_src src[2]) {
+	const struct pwi_hdr *h = (const void*)b;
+	if ((len < sizeof(*h))||(memcmp(h->magic, PWI_MAGIC, 8) != 0)) return 0;
+	if (memcmp(h->src, src, sizeof(h->src)) != 0) return 0;
+	if ((!h->nb)||(h->nb & (h->nb-1))||(h->nb > len)||(h->nu > len)||(h->ng > len)) return 0;
+	size_t l = sizeof(*h) + h->nb * 2 * sizeof(uint32_t) + (h->nu + h->ng) * sizeof(struct pwi_ent);
+	return (h->slen) && (l + h->slen == len) && (!b[len-1]);
+}
+
+/* Where the index is kept. NULL if there is no such place. */
+static char *pwi_cache_fn(struct pwi_src src[2]) {
+	char *x = getenv("XDG_CACHE_HOME");
+	char *h = getenv("HOME");
+	char *d, *fn;
+	if ((x)&&(*x == '/')) d = strdup(x);
+	else if ((h)&&(*h)) d = strdcat(h, "/.cache");
+	else return NULL;
+	if (!d) return NULL;
+	(void) mkdir(d, 0700);
+	uint64_t k = fnv1a(0xcbf29ce484222325ULL, src, 2 * sizeof(*src));
+	int r = asprintf(&fn, "%s/nssu", d);
+	if ((r >= 0)&&(mkdir(fn, 0700) != 0)&&(errno != EEXIST)) r = -1;
+	free(fn);
+	if ((r < 0)||(asprintf(&fn, "%s/nssu/%016llx.pwi", d, (unsigned long long)k) < 0)) fn = NULL;
+	free(d);
+	return fn;
+}
+
+/* Map (or build and save) the index. Leaves pwi NULL without /etc/passwd. */
+static void pwi_open(void) {
+	struct pwi_src src[2];
+	int pfd = open("/etc/passwd", O_RDONLY|O_CLOEXEC);
+	if (pfd < 0) return;
+	int gfd = open("/etc/group", O_RDONLY|O_CLOEXEC);
+	pwi_stat(pfd, &src[0]);
+	pwi_stat(gfd, &src[1]);
+	/* Only the identity of the files goes into the name. */
+	struct pwi_src key[2] = { { src[0].dev, src[0].ino }, { src[1].dev, src[1].ino } };
+	char *fn = pwi_cache_fn(key);
+	int fd = fn ? open(fn, O_RDONLY|O_CLOEXEC) : -1;
+	struct stat st;
+	if ((fd >= 0)&&(fstat(fd, &st) == 0)&&(st.st_size > 0)) {
+		char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			if (pwi_valid(m, st.st_size, src)) pwi = m;
+			else munmap(m, st.st_size);
+		}
+	}
+	if (fd >= 0) close(fd);
+	if (!pwi) {
+		char *b;
+		size_t len = pwi_build(pfd, gfd, src, &b);
+		pwi = b;
+		if (fn) {
+			/* Into a temporary file first, so that parallel runs dont see half of it. */
+			char *tfn;
+			if (asprintf(&tfn, "%s.%d", fn, (int)getpid()) < 0) perror_msg_and_die("asprintf");
+			fd = open(tfn, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+			if (fd >= 0) {
+				int r = write(fd, b, len);
+				close(fd);
+				if ((r != len)||(rename(tfn, fn) != 0)) unlink(tfn);
+			}
+			free(tfn);
+		}
+	}
+	free(fn);
+	close(pfd);
+	if (gfd >= 0) close(gfd);
+}
+
+/* The strings of the index. */
+static const char *pwi_str(void) {
+	const struct pwi_hdr *h = (const void*)pwi;
+	return pwi + sizeof(*h) + h->nb * 2 * sizeof(uint32_t) + (h->nu + h->ng) * sizeof(struct pwi_ent);
+}
+
+static const struct pwi_ent *pwi_find(int grp, const char *name) {
+	if (!pwi) return NULL;
+	const struct pwi_hdr *h = (const void*)pwi;
+	const uint32_t *b = (const void*)(pwi + sizeof(*h));
+	const struct pwi_ent *e = (const void*)(b + h->nb * 2);
+	const char *str = pwi_str();
+	uint32_t n = grp ? h->ng : h->nu;
+	if (grp) {
+		b += h->nb;
+		e += h->nu;
+	}
+	uint32_t i = b[fnv1a(0xcbf29ce484222325ULL, name, strlen(name)) & (h->nb-1)];
+	for (int c=0;(i)&&(i <= n)&&(c < n);c++) {
+		const struct pwi_ent *x = &e[i-1];
+		if ((x->name < h->slen)&&(strcmp(str + x->name, name) == 0)) return x;
+		i = x->next;
+	}
+	return NULL;
+}
+
+/* getpwnam() through the index, getpwnam() itself for what it doesnt have. */
+static struct passwd *pwi_getpwnam(const char *name) {
+	static struct passwd pw;
+	const struct pwi_ent *e = pwi_find(0, name);
+	if (!e) return getpwnam(name);
+	const struct pwi_hdr *h = (const void*)pwi;
+	const char *str = pwi_str();
+	if ((e->dir >= h->slen)||(e->shell >= h->slen)) return NULL;
+	pw.pw_name = (char*)str + e->name;
+	pw.pw_uid = e->id;
+	pw.pw_gid = e->gid;
+	pw.pw_dir = (char*)str + e->dir;
+	pw.pw_shell = (char*)str + e->shell;
+	return &pw;
+}
+
+/* The gid of a group (or a number), -1 if there is no such group. */
+static int pwi_getgid(const char *name) {
+	const struct pwi_ent *e = pwi_find(1, name);
+	if (e) return e->id;
+	struct group *gr = getgrnam(name);
+	if (gr) return gr->gr_gid;
+	char *end;
+	long g = strtol(name, &end, 10);
+	return ((*name)&&(!*end)&&(g >= 0)) ? g : -1;
+}
+
 void msetenv(const char *name, const char *value) {
 	if (setenv(name, value, 1)) perror_msg_and_die2("setenv", name);
 }
 
 void usage(char *name) {
-	fprintf(stderr, "Usage: %s [-mpl] [-] [-s shell] [user] [-c CMD] [ARGS]"
+	fprintf(stderr, "Usage: %s [-mplF] [-] [-s shell] [-g group] [user] [-c CMD] [ARGS]"
+		"\n       %s -D sock"
 		"\n\n"
 		"Change apparent identity to that of user (by default, root) and run shell\n"
 		"\n\t-,-l\tClear environment, go to home, run shell as login shell"
 		"\n\t-p,-m\tDo not set new $HOME, $SHELL, $USER, $LOGNAME"
 		"\n\t-c CMD\tCommand to pass to 'sh -c'"
 		"\n\t-s SH\tShell to use"
-	"\n", name);
+		"\n\t-g GRP\tGroup to use (instead of that of the user)"
+		"\n\t-F\tIgnore chown and set*id calls (as unsfilter does)"
+		"\n\t-D sock\tServe identity switches on sock (used by nssu with $NSSU_SOCK=sock)"
+	"\n", name, name);
 	exit(1);
 }
 
@@ -82,6 +626,9 @@ int main(int argc, char **argv) {
 	char * shell = NULL;
 	char * user = NULL;
 	char * cmd = NULL;
+	int use_filter = 0;
+	char * srv_sock = NULL;
+	char * group = NULL;
 
 	int muid = getuid();
 	int mgid = getgid();
@@ -90,16 +637,21 @@ int main(int argc, char **argv) {
 	int tgid = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "mplc:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "mplFc:s:g:D:")) != -1) {
 		switch (opt) {
 			default: usage(argv[0]); break;
 			case 'm': case 'p': env_preserve = 1; break;
 			case 'l': login = 1; break;
 			case 'c': cmd = optarg; break;
 			case 's': shell = optarg; break;
+			case 'g': group = optarg; break;
+			case 'F': use_filter = 1; break;
+			case 'D': srv_sock = optarg; break;
 		}
 	}
 
+	if (srv_sock) srv_serve(srv_sock);
+
 	/* Detect '-' (login) */
 	if (argv[optind] && argv[optind][0] == '-' && argv[optind][1] == 0) {
 		login = 1;
@@ -113,7 +665,8 @@ int main(int argc, char **argv) {
 
 	/* Defaults are for root so if no specific user was requested and we cant
 	 * find passwd info then we can live with the defaults. */
-	struct passwd *pw = getpwnam(user?user:"root");
+	pwi_open();
+	struct passwd *pw = pwi_getpwnam(user?user:"root");
 	if ((user)&&(!pw)) error_msg_and_die("Unknown user");
 	if (!user) user = "root"; /* Future doesnt need to know */
 
@@ -127,6 +680,11 @@ int main(int argc, char **argv) {
 		home = pw->pw_dir;
 	}
 
+	if (group) {
+		tgid = pwi_getgid(group);
+		if (tgid < 0) error_msg_and_die("Unknown group");
+	}
+
 	if (!shell && env_preserve) {
 		shell = getenv("SHELL");
 	}
@@ -134,13 +692,21 @@ int main(int argc, char **argv) {
 	if (!shell) shell = pw_shell;
 
 	/* Dont change namespace if no change is necessary. */
-	if (tuid != muid) {
+	int use_srv = 0;
+	int change = (tuid != muid)||((group)&&(tgid != mgid));
+	if (change) {
 		/* Check that we _cannot_ setuid() to target. If we can, we have
 		 * too much actual power ;) */
-		int r = setuid(tuid);
-		if ( ((r==0)&&(getuid()==tuid)) || ((r==-1)&&(errno==EAGAIN)) )
+		int r = (tuid != muid) ? setuid(tuid) : setgid(tgid);
+		int now = (tuid != muid) ? (getuid()==tuid) : (getgid()==tgid);
+		if ( ((r==0)&&(now)) || ((r==-1)&&(errno==EAGAIN)) )
 			error_msg_and_die("Do not use nssu while actually root");
 
+		/* With an identity server, it does the switch (after our chdir). */
+		use_srv = getenv("NSSU_SOCK") != NULL;
+	}
+
+	if ((change)&&(!use_srv)) {
 		if (unshare(CLONE_NEWUSER) != 0)
 			perror_msg_and_die("unshare");
 
@@ -183,6 +749,16 @@ int main(int argc, char **argv) {
 	if (login) arg0 = strdcat("-", arg0);
 	argv[--optind] = arg0;
 
+	if (use_srv) {
+		int fd = sock_connect(getenv("NSSU_SOCK"));
+		if (fd < 0) perror_msg_and_die2("connect", getenv("NSSU_SOCK"));
+		srv_run(fd, shell, argv+optind, tuid, tgid, use_filter);
+		error_msg_and_die("Cannot send to the identity server");
+	}
+
+	if ((use_filter)&&(nsfilter_apply() != 0))
+		perror_msg_and_die("seccomp filter");
+
 	execvp(shell,argv+optind);
 	perror("execvp");
 	exit(127); /* Specific code for failure to run command. */
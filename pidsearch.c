@@ -10,52 +10,726 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
-#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <regex.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
-static int proc_list_pids(const char *dir, DIR **proc) {
-	if (!(*proc)) {
-		*proc = opendir(dir);
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static void perror_msg_and_die(const char* msg) {
+	perror(msg);
+	exit(1);
+}
+
+static void error_msg_and_die(const char* msg) {
+	fprintf(stderr,"%s\n", msg);
+	exit(1);
+}
+
+/* What to look for. A process matches if its name (comm, or the cmdline
+ * with -f) matches any of the patterns (or there are none), and it passes
+ * the uid and state checks. */
+static char **subs = NULL; /* Substrings */
+static int nsubs = 0;
+static regex_t *res = NULL;
+static int nres = 0;
+static int full = 0; /* Match the cmdline instead of comm */
+static long m_uid = -1;
+static const char *m_states = NULL;
+
+/* Output: space separated (as always), NUL separated, or JSON lines. */
+enum { OUT_SPACE, OUT_NUL, OUT_JSON };
+static int out_fmt = OUT_SPACE;
+
+static int proc_dfd = -1;
+
+/* Namespaces (-n): the pid and mount namespace of each match, its pid in
+ * its own pid namespace, and the root of the init of that. The part per
+ * namespace is looked up once, by the first of its processes we see. */
+static int nsmode = 0;
+
+struct pidns {
+	uint64_t ino;
+	int init; /* Its pid 1 (in proc-dir), 0 = not found */
+	char *root; /* Of the init, NULL = dont know */
+	struct pidns *next;
+};
+
+#define NS_HASH 256
+static struct pidns *ns_hash[NS_HASH];
+static pthread_mutex_t ns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Watch mode (-w): the matching processes, a bit per pid. */
+#define PSET_MAX (1 << 22) /* PID_MAX_LIMIT */
+static uint64_t *pset = NULL;
+
+static int pset_test(int pid) {
+	return (pid < PSET_MAX)&&(pset[pid / 64] & (1ULL << (pid % 64)));
+}
+
+/* Returns the old bit, the threads of a scan share the words. */
+static int pset_set(int pid) {
+	if (pid >= PSET_MAX) return 1;
+	uint64_t b = 1ULL << (pid % 64);
+	return (__atomic_fetch_or(&pset[pid / 64], b, __ATOMIC_RELAXED) & b) != 0;
+}
+
+static void pset_clr(int pid) {
+	if (pid < PSET_MAX) pset[pid / 64] &= ~(1ULL << (pid % 64));
+}
+
+/* The pids, as listed by getdents64 in one go. */
+static int *pids = NULL;
+static int npids = 0;
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static void proc_list_pids(void) {
+	int ma = 0;
+	char *buf = malloc(1 << 16);
+	if (!buf) perror_msg_and_die("malloc");
+	int r;
+	while ((r = syscall(SYS_getdents64, proc_dfd, buf, 1 << 16)) > 0) {
+		for (int o = 0; o < r;) {
+			struct linux_dirent64 *d = (void*)(buf + o);
+			o += d->d_reclen;
+			char *n = d->d_name;
+			if ((*n < '1')||(*n > '9')) continue;
+			int pid = 0;
+			for (;(*n >= '0')&&(*n <= '9');n++) pid = pid * 10 + (*n - '0');
+			if (*n) continue;
+			if (npids == ma) {
+				ma += 4096;
+				pids = realloc(pids, ma * sizeof(int));
+				if (!pids) perror_msg_and_die("(re)alloc");
+			}
+			pids[npids++] = pid;
+		}
 	}
-	if (!(*proc)) return 0;
-	struct dirent *d;
-	while ((d = readdir(*proc))) {
+	if (r < 0) perror_msg_and_die("getdents64");
+	free(buf);
+}
+
+/* Read pid/fn into buf (NUL terminated, cut at len-1). Returns the length,
+ * -1 if the process is gone (which is fine). */
+static int proc_read(int pid, const char *fn, char *buf, int len) {
+	char path[32];
+	snprintf(path, sizeof(path), "%d/%s", pid, fn);
+	int fd = openat(proc_dfd, path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return -1;
+	int l = 0;
+	do {
+		int r = read(fd, buf+l, len-1-l);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r <= 0) break; /* End of file */
+		l += r;
+	} while (l<len-1);
+	close(fd);
+	buf[l] = 0;
+	return l;
+}
+
+/* The pid in its own pid namespace (the last of NSpid), how deep that is
+ * (the count of NSpid) and the parent (if ppid), from pid/status. -1 if
+ * the process is gone. */
+static int proc_nspid(int pid, int *depth, int *ppid) {
+	char buf[4096];
+	if (proc_read(pid, "status", buf, sizeof(buf)) < 0) return -1;
+	char *p;
+	if (ppid) {
+		p = strstr(buf, "\nPPid:");
+		*ppid = p ? atoi(p + 6) : 0;
+	}
+	*depth = 1;
+	p = strstr(buf, "\nNSpid:");
+	if (!p) return pid; /* Older than 4.1 */
+	int n = pid, d = 0;
+	for (p += 7;;d++) {
 		char *e;
-		errno = 0;
-		long int pid = strtol(d->d_name,&e,10);
-		if (errno) continue;
-		if (*e != 0) continue;
-		return pid;
-	}
-	closedir(*proc);
-	*proc = NULL;
+		long v = strtol(p, &e, 10);
+		if (e == p) break;
+		n = v;
+		p = e;
+	}
+	if (d) *depth = d;
+	return n;
+}
+
+/* The init of the pid namespace of pid, up by the parents until the one
+ * that is 1 in there. 0 if it is not to be found. */
+static int ns_init(int pid, int depth) {
+	for (int i=0;(pid > 0)&&(i<4096);i++) {
+		int d, ppid;
+		int n = proc_nspid(pid, &d, &ppid);
+		if ((n < 0)||(d != depth)) return 0;
+		if (n == 1) return pid;
+		pid = ppid;
+	}
+	return 0;
+}
+
+/* The root of pid: the root (field 4) of the mount at / in its
+ * mountinfo, the top one of them. Not /proc/N/root, that is / for
+ * anything that did a pivot_root(). NULL if not to be known. */
+static char *ns_root(int pid) {
+	char path[32];
+	snprintf(path, sizeof(path), "%d/mountinfo", pid);
+	FILE *f = fdopen(openat(proc_dfd, path, O_RDONLY|O_CLOEXEC), "r");
+	if (!f) return NULL;
+	char *l = NULL, *root = NULL;
+	size_t ls = 0;
+	while (getline(&l, &ls, f) > 0) {
+		char r[PATH_MAX], mp[8];
+		if ((sscanf(l, "%*d %*d %*s %4095s %7s", r, mp) != 2)||(strcmp(mp, "/") != 0)) continue;
+		/* Undo the octal escapes (of space, tab, newline and \). */
+		char *o = r;
+		for (char *c = r; *c; c++) {
+			if ((c[0] == '\\')&&(c[1] >= '0')&&(c[1] <= '3')&&(c[2] >= '0')&&(c[2] <= '7')&&(c[3] >= '0')&&(c[3] <= '7')) {
+				*o++ = (c[1] - '0') * 64 + (c[2] - '0') * 8 + (c[3] - '0');
+				c += 3;
+			} else *o++ = *c;
+		}
+		*o = 0;
+		free(root);
+		root = strdup(r);
+	}
+	free(l);
+	fclose(f);
+	return root;
+}
+
+static struct pidns *ns_find(uint64_t ino) {
+	struct pidns *n;
+	for (n = ns_hash[ino % NS_HASH]; n; n = n->next) if (n->ino == ino) break;
+	return n;
+}
+
+/* The pid namespace ino (that pid at depth is in), from the cache. The
+ * looking up is done outside of the lock, so that the threads dont wait
+ * for each other: a namespace might get looked up twice, the first one
+ * in wins. */
+static struct pidns *ns_get(uint64_t ino, int pid, int depth) {
+	pthread_mutex_lock(&ns_lock);
+	struct pidns *n = ns_find(ino);
+	int done = (n)&&(n->init);
+	pthread_mutex_unlock(&ns_lock);
+	if (done) return n;
+
+	/* Try again from the next one if this had no way up (a kernel thread). */
+	int init = ns_init(pid, depth);
+	char *root = init ? ns_root(init) : NULL;
+
+	pthread_mutex_lock(&ns_lock);
+	n = ns_find(ino);
+	if (!n) {
+		struct pidns **h = &ns_hash[ino % NS_HASH];
+		n = calloc(1, sizeof(*n));
+		if (!n) perror_msg_and_die("calloc");
+		n->ino = ino;
+		n->next = *h;
+		*h = n;
+	}
+	if ((!n->init)&&(init)) {
+		n->root = root;
+		root = NULL;
+		n->init = init;
+	}
+	pthread_mutex_unlock(&ns_lock);
+	free(root);
+	return n;
+}
+
+/* A match in o (with -n, of a scan that groups them). */
+struct nsrec {
+	uint64_t pidns, mntns;
+	int pid;
+	size_t off, len;
+	struct pidns *ns;
+	struct obuf *o;
+};
+
+/* A growing output buffer, one per thread. */
+struct obuf {
+	char *b;
+	size_t l, ml;
+	struct nsrec *r;
+	int nr, mr;
+};
+
+static void ob_put(struct obuf *o, const char *s, size_t l) {
+	if (o->l + l > o->ml) {
+		o->ml = (o->l + l) * 2 + 4096;
+		o->b = realloc(o->b, o->ml);
+		if (!o->b) perror_msg_and_die("(re)alloc");
+	}
+	memcpy(o->b + o->l, s, l);
+	o->l += l;
+}
+
+static void ob_json_str(struct obuf *o, const char *s) {
+	ob_put(o, "\"", 1);
+	for (;*s;s++) {
+		char e[8];
+		unsigned char c = *s;
+		if ((c < 0x20)||(c == '"')||(c == '\\')) {
+			ob_put(o, e, snprintf(e, sizeof(e), "\\u%04x", c));
+		} else {
+			ob_put(o, s, 1);
+		}
+	}
+	ob_put(o, "\"", 1);
+}
+
+static int name_match(const char *n) {
+	if ((!nsubs)&&(!nres)) return 1;
+	for (int i=0;i<nsubs;i++) if (strstr(n, subs[i])) return 1;
+	for (int i=0;i<nres;i++) if (regexec(&res[i], n, 0, NULL, 0) == 0) return 1;
 	return 0;
 }
 
+/* Check one process, and if it matches put it in o. When watching,
+ * only new ones are put there, as event ev. Returns if it matched. */
+static int scan_pid(int pid, struct obuf *o, const char *ev) {
+	char comm[32]; /* comm has a short name */
+	char cmd[4096];
+	char stat[512];
+	char state = 0;
+	uid_t uid = 0;
+	int json = out_fmt == OUT_JSON;
+
+	if ((m_uid >= 0)||(json)) {
+		struct stat st;
+		char path[16];
+		snprintf(path, sizeof(path), "%d", pid);
+		if (fstatat(proc_dfd, path, &st, 0) != 0) return 0;
+		uid = st.st_uid; /* The owner of /proc/N is the effective uid. */
+		if ((m_uid >= 0)&&(uid != m_uid)) return 0;
+	}
+	if ((m_states)||(json)) {
+		/* "pid (comm) S ...", and comm may have a ')' in it. */
+		if (proc_read(pid, "stat", stat, sizeof(stat)) < 0) return 0;
+		char *p = strrchr(stat, ')');
+		if ((p)&&(p[1] == ' ')) state = p[2];
+		if ((m_states)&&((!state)||(!strchr(m_states, state)))) return 0;
+	}
+	int cl = -1;
+	if ((full)||(json)) {
+		cl = proc_read(pid, "cmdline", cmd, sizeof(cmd));
+		if (cl < 0) return 0;
+		while ((cl)&&(!cmd[cl-1])) cl--; /* The last NUL(s) */
+		for (int i=0;i<cl;i++) if (!cmd[i]) cmd[i] = ' ';
+		cmd[cl] = 0;
+	}
+	/* Like pgrep -f, use comm for those without a cmdline (kernel threads). */
+	if ((!full)||(!cl)||(json)) {
+		int l = proc_read(pid, "comm", comm, sizeof(comm));
+		if (l <= 0) return 0;
+		if (comm[l-1] == '\n') comm[--l] = 0;
+	}
+	if (!name_match(((full)&&(cl > 0)) ? cmd : comm)) return 0;
+
+	uint64_t pidns = 0, mntns = 0;
+	int nspid = pid;
+	struct pidns *ns = NULL;
+	if (nsmode) {
+		/* As an user, the ns of the others are not ours to see (0). */
+		struct stat st;
+		char path[32];
+		snprintf(path, sizeof(path), "%d/ns/pid", pid);
+		if (fstatat(proc_dfd, path, &st, 0) == 0) pidns = st.st_ino;
+		snprintf(path, sizeof(path), "%d/ns/mnt", pid);
+		if (fstatat(proc_dfd, path, &st, 0) == 0) mntns = st.st_ino;
+		int depth;
+		nspid = proc_nspid(pid, &depth, NULL);
+		if (nspid < 0) return 0;
+		if (pidns) ns = ns_get(pidns, pid, depth);
+	}
+
+	if ((pset)&&(pset_set(pid))) return 1;
+
+	char buf[96];
+	size_t start = o->l;
+	switch (out_fmt) {
+		case OUT_SPACE:
+			if ((nsmode)&&(!ev)) {
+				/* Grouped under a line of their namespace, see ns_flush(). */
+				ob_put(o, buf, snprintf(buf, sizeof(buf), " %d/%d", pid, nspid));
+				break;
+			}
+			/* Fall through */
+		case OUT_NUL:
+			if (nsmode) {
+				ob_put(o, buf, snprintf(buf, sizeof(buf), "%s%s%d %d %llu %llu ", ev ? ev : "", ev ? " " : "",
+					pid, nspid, (unsigned long long)pidns, (unsigned long long)mntns));
+				const char *r = (ns)&&(ns->root) ? ns->root : "?";
+				ob_put(o, r, strlen(r));
+				ob_put(o, out_fmt == OUT_NUL ? "" : "\n", 1);
+			} else if (out_fmt == OUT_SPACE) {
+				ob_put(o, buf, snprintf(buf, sizeof(buf), ev ? "%s %d\n" : "%s%d ", ev ? ev : "", pid));
+			} else {
+				ob_put(o, buf, snprintf(buf, sizeof(buf), ev ? "%s %d" : "%s%d", ev ? ev : "", pid) + 1);
+			}
+			break;
+		case OUT_JSON:
+			if (ev) ob_put(o, buf, snprintf(buf, sizeof(buf), "{\"event\":\"%s\",", ev));
+			else ob_put(o, "{", 1);
+			ob_put(o, buf, snprintf(buf, sizeof(buf), "\"pid\":%d,\"uid\":%u,\"state\":\"%c\",\"comm\":",
+				pid, (unsigned)uid, state ? state : '?'));
+			ob_json_str(o, comm);
+			ob_put(o, ",\"cmdline\":", 11);
+			ob_json_str(o, cmd);
+			if (nsmode) {
+				ob_put(o, buf, snprintf(buf, sizeof(buf), ",\"nspid\":%d,\"pidns\":%llu,\"mntns\":%llu,\"root\":",
+					nspid, (unsigned long long)pidns, (unsigned long long)mntns));
+				if ((ns)&&(ns->root)) ob_json_str(o, ns->root);
+				else ob_put(o, "null", 4);
+			}
+			ob_put(o, "}\n", 2);
+			break;
+	}
+	if ((nsmode)&&(!ev)) {
+		if (o->nr == o->mr) {
+			o->mr = o->mr * 2 + 256;
+			o->r = realloc(o->r, o->mr * sizeof(struct nsrec));
+			if (!o->r) perror_msg_and_die("(re)alloc");
+		}
+		o->r[o->nr++] = (struct nsrec){ pidns, mntns, pid, start, o->l - start, ns, o };
+	}
+	return 1;
+}
+
+/* A thread does a contiguous part of the pids, so the output stays in order. */
+struct scan_part {
+	pthread_t t;
+	int from, to;
+	const char *ev;
+	struct obuf o;
+};
+
+static void *scan_thread(void *arg) {
+	struct scan_part *s = arg;
+	for (int i=s->from;i<s->to;i++) scan_pid(pids[i], &s->o, s->ev);
+	return NULL;
+}
+
+static void ob_flush(struct obuf *o) {
+	if ((o->l)&&(fwrite(o->b, 1, o->l, stdout) != o->l))
+		perror_msg_and_die("write");
+	o->l = 0;
+	if (pset) fflush(stdout);
+}
+
+static int nsrec_cmp(const void *a, const void *b) {
+	const struct nsrec *x = a, *y = b;
+	if (x->pidns != y->pidns) return x->pidns < y->pidns ? -1 : 1;
+	if (x->mntns != y->mntns) return x->mntns < y->mntns ? -1 : 1;
+	return x->pid - y->pid;
+}
+
+/* Write the matches of the n parts grouped by their namespaces (-n). */
+static void ns_flush(struct scan_part *sp, int n) {
+	static struct obuf out;
+	int nr = 0;
+	for (int i=0;i<n;i++) nr += sp[i].o.nr;
+	struct nsrec *r = malloc((nr + 1) * sizeof(*r));
+	if (!r) perror_msg_and_die("malloc");
+	nr = 0;
+	for (int i=0;i<n;i++) {
+		memcpy(r + nr, sp[i].o.r, sp[i].o.nr * sizeof(*r));
+		nr += sp[i].o.nr;
+	}
+	qsort(r, nr, sizeof(*r), nsrec_cmp);
+	for (int i=0;i<nr;i++) {
+		if ((out_fmt == OUT_SPACE)&&((!i)||(r[i].pidns != r[i-1].pidns)||(r[i].mntns != r[i-1].mntns))) {
+			char buf[64];
+			if (i) ob_put(&out, "\n", 1);
+			ob_put(&out, buf, snprintf(buf, sizeof(buf), "pid:[%llu] mnt:[%llu] ",
+				(unsigned long long)r[i].pidns, (unsigned long long)r[i].mntns));
+			const char *root = (r[i].ns)&&(r[i].ns->root) ? r[i].ns->root : "?";
+			ob_put(&out, root, strlen(root));
+			ob_put(&out, ":", 1);
+		}
+		ob_put(&out, r[i].o->b + r[i].off, r[i].len);
+	}
+	if ((out_fmt == OUT_SPACE)&&(nr)) ob_put(&out, "\n", 1);
+	free(r);
+	for (int i=0;i<n;i++) sp[i].o.l = sp[i].o.nr = 0;
+	ob_flush(&out);
+}
+
+/* Scan all of proc-dir, in threads. Matches are reported as ev. */
+static void scan_all(int threads, const char *ev) {
+	npids = 0;
+	if (lseek(proc_dfd, 0, SEEK_SET) != 0) perror_msg_and_die("lseek");
+	proc_list_pids();
+
+	/* Not worth a thread for less than a few hundred. */
+	if (threads > npids / 256) threads = npids / 256;
+	if (threads < 1) threads = 1;
+	static struct scan_part *sp = NULL;
+	static int nsp = 0;
+	if (threads > nsp) {
+		sp = realloc(sp, threads * sizeof(*sp));
+		if (!sp) perror_msg_and_die("(re)alloc");
+		memset(sp + nsp, 0, (threads - nsp) * sizeof(*sp));
+		nsp = threads;
+	}
+	for (int i=0;i<threads;i++) {
+		sp[i].from = (int64_t)npids * i / threads;
+		sp[i].to = (int64_t)npids * (i + 1) / threads;
+		sp[i].ev = ev;
+		if ((i)&&(pthread_create(&sp[i].t, NULL, scan_thread, &sp[i]) != 0))
+			error_msg_and_die("pthread_create failed");
+	}
+	scan_thread(&sp[0]);
+	for (int i=0;i<threads;i++) {
+		if (i) pthread_join(sp[i].t, NULL);
+		if ((!nsmode)||(ev)) ob_flush(&sp[i].o);
+	}
+	if ((nsmode)&&(!ev)) ns_flush(sp, threads);
+}
+
+/* Generate a return value from a wait() status variable. */
+static int wait_retval(int status) {
+	if (WIFEXITED(status)) return WEXITSTATUS(status);
+	if (WIFSIGNALED(status)) return WTERMSIG(status)+128;
+	return 255;
+}
+
+/* A matching process went away (ev "exit", with status st, -1 = dont
+ * know), or stopped matching ("unmatch", when it exec()ed). */
+static void report_exit(struct obuf *o, int pid, const char *ev, int st) {
+	char buf[96];
+	pset_clr(pid);
+	int l;
+	if (out_fmt == OUT_JSON) {
+		l = st < 0 ? snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"pid\":%d}\n", ev, pid) :
+			snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"pid\":%d,\"status\":%d}\n", ev, pid, st);
+	} else {
+		l = st < 0 ? snprintf(buf, sizeof(buf), "%s %d", ev, pid) :
+			snprintf(buf, sizeof(buf), "%s %d %d", ev, pid, st);
+		buf[l++] = out_fmt == OUT_NUL ? 0 : '\n';
+	}
+	ob_put(o, buf, l);
+}
+
+/* Subscribe to the proc connector. -1 if we cant (it needs CAP_NET_ADMIN). */
+static int cn_open(void) {
+	int fd = socket(PF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0) return -1;
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC, .nl_pid = 0 };
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) goto bad;
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = { 0 };
+	struct nlmsghdr *nh = (void*)buf;
+	struct cn_msg *cn = NLMSG_DATA(nh);
+	nh->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(enum proc_cn_mcast_op));
+	nh->nlmsg_type = NLMSG_DONE;
+	nh->nlmsg_pid = getpid();
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof(enum proc_cn_mcast_op);
+	*(enum proc_cn_mcast_op*)cn->data = PROC_CN_MCAST_LISTEN;
+	cn->ack = getpid();
+	if (send(fd, buf, nh->nlmsg_len, 0) != nh->nlmsg_len) goto bad;
+
+	/* The answer (an ack event with the error) tells if we get events. */
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char rb[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	while (poll(&pfd, 1, 1000) == 1) {
+		int r = recv(fd, rb, sizeof(rb), 0);
+		if (r <= 0) break;
+		for (nh = (void*)rb; NLMSG_OK(nh, r); nh = NLMSG_NEXT(nh, r)) {
+			cn = NLMSG_DATA(nh);
+			struct proc_event *e = (void*)cn->data;
+			if ((e->what == PROC_EVENT_NONE)&&(cn->ack == getpid() + 1))
+				return e->event_data.ack.err ? (close(fd), -1) : fd;
+		}
+	}
+bad:
+	close(fd);
+	return -1;
+}
+
+/* Handle the events in one message from the proc connector. */
+static void cn_events(int fd, struct obuf *o, int threads) {
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	int r = recv(fd, buf, sizeof(buf), 0);
+	if (r < 0) {
+		if (errno == EINTR) return;
+		if (errno != ENOBUFS) perror_msg_and_die("recv(proc connector)");
+		/* Lost some, so look again: for the exits, then for the new ones. */
+		for (int p=1;p<PSET_MAX;p++) {
+			if (!pset_test(p)) continue;
+			char path[16];
+			struct stat st;
+			snprintf(path, sizeof(path), "%d", p);
+			if (fstatat(proc_dfd, path, &st, 0) != 0) report_exit(o, p, "exit", -1);
+		}
+		ob_flush(o);
+		scan_all(threads, "found");
+		return;
+	}
+	for (struct nlmsghdr *nh = (void*)buf; NLMSG_OK(nh, r); nh = NLMSG_NEXT(nh, r)) {
+		if (nh->nlmsg_type != NLMSG_DONE) continue;
+		struct cn_msg *cn = NLMSG_DATA(nh);
+		if ((cn->id.idx != CN_IDX_PROC)||(cn->id.val != CN_VAL_PROC)) continue;
+		struct proc_event *e = (void*)cn->data;
+		switch (e->what) {
+			case PROC_EVENT_FORK:
+				/* A new process (not thread) of a matching one. */
+				if ((e->event_data.fork.child_pid == e->event_data.fork.child_tgid)&&
+					(pset_test(e->event_data.fork.parent_tgid)))
+					scan_pid(e->event_data.fork.child_tgid, o, "fork");
+				break;
+			case PROC_EVENT_EXEC: {
+				/* It is a new program, so it might not match anymore. */
+				int p = e->event_data.exec.process_tgid, was = pset_test(p);
+				pset_clr(p);
+				if ((!scan_pid(p, o, "exec"))&&(was)) report_exit(o, p, "unmatch", -1);
+				break;
+			}
+			case PROC_EVENT_EXIT:
+				if ((e->event_data.exit.process_pid == e->event_data.exit.process_tgid)&&
+					(pset_test(e->event_data.exit.process_tgid)))
+					report_exit(o, e->event_data.exit.process_tgid, "exit", wait_retval(e->event_data.exit.exit_code));
+				break;
+			default:
+				break;
+		}
+	}
+	ob_flush(o);
+}
+
+/* Watch for matching processes: report the ones there are, then the
+ * ones that start (exec, or fork of a matching one) and exit, from the
+ * proc connector. Without it, wait on pidfds of the ones we know for
+ * their exit, and look for new ones every interval ms. Does not return. */
+static void watch(int threads, int interval) {
+	pset = calloc(PSET_MAX / 64, sizeof(uint64_t));
+	if (!pset) perror_msg_and_die("calloc");
+	struct obuf o = { NULL, 0, 0 };
+	/* Subscribe before the first scan, so nothing falls in between. */
+	int cfd = cn_open();
+	scan_all(threads, "found");
+	if (cfd >= 0) {
+		do cn_events(cfd, &o, threads); while (1);
+	}
+
+	/* Which of pset have a pidfd in ep. */
+	uint64_t *pfds = calloc(PSET_MAX / 64, sizeof(uint64_t));
+	if (!pfds) perror_msg_and_die("calloc");
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) perror_msg_and_die("epoll_create1");
+	do {
+		for (int w=0;w<PSET_MAX/64;w++) {
+			uint64_t n = pset[w] & ~pfds[w];
+			for (int b=0;n;b++,n>>=1) {
+				if (!(n & 1)) continue;
+				int pid = w * 64 + b;
+				int fd = syscall(SYS_pidfd_open, pid, 0);
+				if (fd < 0) {
+					if (errno == ESRCH) report_exit(&o, pid, "exit", -1);
+					continue;
+				}
+				struct epoll_event ev = { .events = EPOLLIN, .data.u64 = ((uint64_t)fd << 32) | pid };
+				if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) perror_msg_and_die("epoll_ctl");
+				pfds[w] |= 1ULL << b;
+			}
+		}
+		ob_flush(&o);
+		struct epoll_event evs[64];
+		int n;
+		while ((n = epoll_wait(ep, evs, 64, interval)) > 0) {
+			for (int i=0;i<n;i++) {
+				int pid = (uint32_t)evs[i].data.u64;
+				epoll_ctl(ep, EPOLL_CTL_DEL, evs[i].data.u64 >> 32, NULL);
+				close(evs[i].data.u64 >> 32);
+				pfds[pid / 64] &= ~(1ULL << (pid % 64));
+				report_exit(&o, pid, "exit", -1);
+			}
+			ob_flush(&o);
+		}
+		if ((n < 0)&&(errno != EINTR)) perror_msg_and_die("epoll_wait");
+		scan_all(threads, "found");
+	} while (1);
+}
+
+static void usage(char *name) {
+	fprintf(stderr,"usage: %s [options] proc-dir [grepname]\n"
+		"\n\tPrints the pids of the processes whose name has grepname in it."
+		"\n\tOptions:"
+		"\n\t-e str\tAlso match names with str in them"
+		"\n\t-r re\tAlso match names matching the (extended) regex re"
+		"\n\t-f\tMatch the full cmdline instead of comm"
+		"\n\t-u uid\tOnly processes with this effective uid"
+		"\n\t-s st\tOnly processes in one of these states (eg. RD)"
+		"\n\t-j n\tUse n threads (default 1)"
+		"\n\t-0\tSeparate the pids with NULs"
+		"\n\t-J\tOutput JSON, one process per line"
+		"\n\t-n\tWith the pid and mount namespaces, the pid in there and the root of its init,\n"
+		"\t\tgrouped by namespace (each line: pid nspid pidns mntns root, when watching or with -0)"
+		"\n\t-w\tWatch: report matching processes as they start and exit"
+		"\n\t-i ms\tWithout the proc connector (as user), look for new ones every ms (default 1000)"
+	"\n\n", name);
+	exit(1);
+}
+
 int main(int argc, char **argv) {
-	if (argc < 3) {
-		fprintf(stderr,"usage: %s proc-dir grepname\n", argv[0]);
-		exit(1);
-	}
-	DIR *d = NULL;
-	int p;
-	char * nbuf = malloc(strlen(argv[1]) + 17); /* [1]/%d/comm\0 = 1+10+5+1 = 17 */
-	while ((p = proc_list_pids(argv[1],&d))) {
-		char name[32]; /* comm has a short name */
-		sprintf(nbuf,"%s/%d/comm",argv[1], p);
-		int fd = open(nbuf, O_RDONLY);
-		if (fd < 0) continue; /* It's fine if processes disappear. */
-		int l = 0;
-		do {
-			int r = read(fd, name+l, 32-l);
-			if ((r==-1)&&(errno==EINTR)) continue;
-			if (r <= 0) break; /* End of file */
-			l += r;
-		} while (l<32);
-		close(fd);
-		if (l>=32) l = 31; /* We cut. */
-		if (!l) continue;
-		name[l] = 0;
-		if (strstr(name,argv[2])) printf("%d ", p);
+	int threads = 1;
+	int watching = 0;
+	int interval = 1000;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:r:fu:s:j:0Jnwi:")) != -1) {
+		switch (opt) {
+			default: usage(argv[0]); break;
+			case 'e':
+				subs = realloc(subs, (nsubs + 1) * sizeof(char*));
+				if (!subs) perror_msg_and_die("(re)alloc");
+				subs[nsubs++] = optarg;
+				break;
+			case 'r':
+				res = realloc(res, (nres + 1) * sizeof(regex_t));
+				if (!res) perror_msg_and_die("(re)alloc");
+				if (regcomp(&res[nres++], optarg, REG_EXTENDED|REG_NOSUB) != 0)
+					error_msg_and_die("Bad regex");
+				break;
+			case 'f': full = 1; break;
+			case 'u': m_uid = atol(optarg); break;
+			case 's': m_states = optarg; break;
+			case 'j': threads = atoi(optarg); break;
+			case '0': out_fmt = OUT_NUL; break;
+			case 'J': out_fmt = OUT_JSON; break;
+			case 'n': nsmode = 1; break;
+			case 'w': watching = 1; break;
+			case 'i': interval = atoi(optarg); break;
+		}
+	}
+	if (argc - optind < 1) usage(argv[0]);
+	if (argv[optind+1]) {
+		subs = realloc(subs, (nsubs + 1) * sizeof(char*));
+		if (!subs) perror_msg_and_die("(re)alloc");
+		subs[nsubs++] = argv[optind+1];
 	}
+
+	proc_dfd = open(argv[optind], O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (proc_dfd < 0) perror_msg_and_die(argv[optind]);
+	if (watching) watch(threads, interval);
+	scan_all(threads, NULL);
 	return 0;
 }
@@ -13,6 +13,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <seccomp.h>
 
 static void perror_msg_and_die2(const char* msg, const char *extra) {
@@ -36,64 +48,751 @@ static void run_prog(char **argv) {
 	exit(127); /* Specific code for failure to run command. */
 }
 
+/* The policy without -f: ignore chown and set*id, etc. Change of groups
+ * or user/fs/etc ids... The *32 ones only exist on some 32-bit arches. */
+static const char default_policy[] =
+	"chown ERRNO(0)\n"
+	"chown32 ERRNO(0)\n"
+	"fchown ERRNO(0)\n"
+	"fchown32 ERRNO(0)\n"
+	"fchownat ERRNO(0)\n"
+	"lchown ERRNO(0)\n"
+	"lchown32 ERRNO(0)\n"
+	"setfsgid ERRNO(0)\n"
+	"setfsgid32 ERRNO(0)\n"
+	"setfsuid ERRNO(0)\n"
+	"setfsuid32 ERRNO(0)\n"
+	"setgid ERRNO(0)\n"
+	"setgid32 ERRNO(0)\n"
+	"setgroups ERRNO(0)\n"
+	"setgroups32 ERRNO(0)\n"
+	"setregid ERRNO(0)\n"
+	"setregid32 ERRNO(0)\n"
+	"setresgid ERRNO(0)\n"
+	"setresgid32 ERRNO(0)\n"
+	"setresuid ERRNO(0)\n"
+	"setresuid32 ERRNO(0)\n"
+	"setreuid ERRNO(0)\n"
+	"setreuid32 ERRNO(0)\n"
+	"setuid ERRNO(0)\n"
+	"setuid32 ERRNO(0)\n";
 
-static void apply_seccomp(void) {
-	int r = 0;
-	scmp_filter_ctx c = seccomp_init(SCMP_ACT_ALLOW);
-	if (!c) error_msg_and_die("seccomp_init failed");
+/* Make new malloc() string c = a + b */
+static char* strdcat(const char *a, const char *b) {
+	size_t la = strlen(a);
+	char* c = malloc(la+strlen(b)+1);
+	if (!c) perror_msg_and_die("malloc");
+	memcpy(c,a,la);
+	strcpy(c+la,b);
+	return c;
+}
+
+static char *pfdreader(int fd, int *l) {
+	int bs = 0;
+	int ds = 0;
+	char *d = NULL;
+	do {
+		if ((bs-ds) < 1024) {
+			bs += 4096;
+			d = realloc(d, bs);
+			if (!d) perror_msg_and_die("(re)alloc");
+		}
+		int r = read(fd, d+ds, bs-ds-1);
+		if ((r==-1)&&(errno==EINTR)) continue;
+		if (r < 0) perror_msg_and_die("read");
+		if (!r) break;
+		ds += r;
+	} while (1);
+	d[ds] = 0;
+	if (l) *l = ds;
+	return d;
+}
+
+/* The syscalls that the fake ownership mode (-D) handles. */
+static const char *fake_syscalls[] = {
+	"stat", "lstat", "fstat", "newfstatat", "statx",
+	"chown", "lchown", "fchown", "fchownat",
+	"chmod", "fchmod", "fchmodat", "fchmodat2", NULL
+};
 
-	/* chown */
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(chown), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(chown32), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(fchown), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(fchown32), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(fchownat), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(lchown), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(lchown32), 0)) < 0) goto err_r;
+static int is_fake_syscall(const char *name) {
+	for (int i=0;fake_syscalls[i];i++)
+		if (strcmp(fake_syscalls[i], name) == 0) return 1;
+	return 0;
+}
+
+/* FNV-1a, to name the cached filters by their policy. */
+static uint64_t fnv1a(uint64_t h, const void *p, size_t l) {
+	const unsigned char *b = p;
+	for (size_t i=0;i<l;i++) {
+		h ^= b[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int parse_action(const char *s, uint32_t *act) {
+	int e;
+	char c;
+	if (strcmp(s, "ALLOW") == 0) *act = SCMP_ACT_ALLOW;
+	else if (strcmp(s, "LOG") == 0) *act = SCMP_ACT_LOG;
+	else if (strcmp(s, "KILL") == 0) *act = SCMP_ACT_KILL;
+	else if (strcmp(s, "TRAP") == 0) *act = SCMP_ACT_TRAP;
+	else if ((sscanf(s, "ERRNO(%d%c", &e, &c) == 2)&&(c == ')')&&(e >= 0)&&(e < 4096))
+		*act = SCMP_ACT_ERRNO(e);
+	else return -1;
+	return 0;
+}
+
+/* An argument condition: argN op value, op one of == != < <= > >=,
+ * or argN&mask==value. */
+static int parse_cond(char *s, struct scmp_arg_cmp *a) {
+	unsigned int n;
+	int o = 0;
+	if ((sscanf(s, "arg%u%n", &n, &o) != 1)||(!o)||(n > 5)) return -1;
+	s += o;
+	char *e;
+	uint64_t mask = 0;
+	enum scmp_compare op;
+	if (*s == '&') {
+		mask = strtoull(s+1, &e, 0);
+		if ((e == s+1)||(strncmp(e, "==", 2) != 0)) return -1;
+		s = e + 2;
+		op = SCMP_CMP_MASKED_EQ;
+	} else if (strncmp(s, "==", 2) == 0) { op = SCMP_CMP_EQ; s += 2; }
+	else if (strncmp(s, "!=", 2) == 0) { op = SCMP_CMP_NE; s += 2; }
+	else if (strncmp(s, "<=", 2) == 0) { op = SCMP_CMP_LE; s += 2; }
+	else if (strncmp(s, ">=", 2) == 0) { op = SCMP_CMP_GE; s += 2; }
+	else if (*s == '<') { op = SCMP_CMP_LT; s++; }
+	else if (*s == '>') { op = SCMP_CMP_GT; s++; }
+	else return -1;
+	uint64_t v = strtoull(s, &e, 0);
+	if ((e == s)||(*e)) return -1;
+	a->arg = n;
+	a->op = op;
+	/* For MASKED_EQ the first datum is the mask. */
+	a->datum_a = op == SCMP_CMP_MASKED_EQ ? mask : v;
+	a->datum_b = op == SCMP_CMP_MASKED_EQ ? v : 0;
+	return 0;
+}
+
+static void policy_error(int line, const char *msg, const char *what) {
+	fprintf(stderr, "policy line %d: %s: %s\n", line, msg, what);
+	exit(1);
+}
+
+/* The policy, one rule per line: "syscall ACTION [conditions...]", with
+ * ACTION one of ALLOW, LOG, KILL, TRAP or ERRNO(n). "default ACTION" sets
+ * what happens to the other syscalls (default ALLOW). # starts a comment.
+ * Returns the default action; the rules are added to c, which has to be
+ * made with it (libseccomp cant change it later), so with c NULL the
+ * policy is just checked. The rules that do what the default does are
+ * left out, libseccomp refuses those. With fake, the rules for the
+ * fake_syscalls are skipped. */
+static uint32_t policy_compile(scmp_filter_ctx c, char *policy, int fake, uint32_t def) {
+	char *lp, *line = strtok_r(policy, "\n", &lp);
+	for (int ln = 1; line; line = strtok_r(NULL, "\n", &lp), ln++) {
+		char *h = strchr(line, '#');
+		if (h) *h = 0;
+		char *tp;
+		char *name = strtok_r(line, " \t", &tp);
+		if (!name) continue;
+		char *as = strtok_r(NULL, " \t", &tp);
+		uint32_t act;
+		if ((!as)||(parse_action(as, &act) != 0))
+			policy_error(ln, "bad action", as ? as : "(none)");
+
+		if (strcmp(name, "default") == 0) {
+			if (!c) def = act;
+			continue;
+		}
+		if ((fake)&&(is_fake_syscall(name))) continue;
+
+		struct scmp_arg_cmp a[6];
+		unsigned int na = 0;
+		char *cs;
+		while ((cs = strtok_r(NULL, " \t", &tp))) {
+			if ((na == 6)||(parse_cond(cs, &a[na]) != 0))
+				policy_error(ln, "bad condition", cs);
+			na++;
+		}
+
+		int nr = seccomp_syscall_resolve_name(name);
+		if (nr == __NR_SCMP_ERROR) policy_error(ln, "unknown syscall", name);
+		if ((!c)||(act == def)) continue;
+		/* Syscalls that dont exist on this arch are fine, they are skipped. */
+		int r = seccomp_rule_add_array(c, act, nr, na, a);
+		if ((r < 0)&&(r != -EDOM)) {
+			errno = -r;
+			perror_msg_and_die2("seccomp_rule_add", name);
+		}
+	}
+	return def;
+}
 
-	/* set*id, etc. Change of groups or user/fs/etc ids... */
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setfsgid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setfsgid32), 0)) < 0) goto err_r;
+/* Load a raw BPF filter as made by seccomp_export_bpf(). Returns -1 if
+ * it cant be, or what seccomp() returned (the listener fd, with flags). */
+static int load_bpf(const char *fn, unsigned int flags) {
+	int fd = open(fn, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return -1;
+	int l;
+	char *d = pfdreader(fd, &l);
+	close(fd);
+	if ((!l)||(l % sizeof(struct sock_filter))||(l > BPF_MAXINSNS * sizeof(struct sock_filter))) {
+		free(d);
+		return -1;
+	}
+	struct sock_fprog p = { .len = l / sizeof(struct sock_filter), .filter = (struct sock_filter*)d };
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+		perror_msg_and_die("prctl(NO_NEW_PRIVS)");
+	int r = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &p);
+	free(d);
+	/* If not, its not a filter for this kernel, make it again. */
+	return r < 0 ? -1 : r;
+}
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setfsuid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setfsuid32), 0)) < 0) goto err_r;
+/* Where the compiled filters are kept: $XDG_CACHE_HOME/unsfilter, or
+ * ~/.cache/unsfilter. NULL if there is no such place. */
+static char *cache_dir(void) {
+	char *x = getenv("XDG_CACHE_HOME");
+	char *h = getenv("HOME");
+	char *d;
+	if ((x)&&(*x == '/')) d = strdup(x);
+	else if ((h)&&(*h)) d = strdcat(h, "/.cache");
+	else return NULL;
+	if (!d) return NULL;
+	(void) mkdir(d, 0700);
+	char *c = strdcat(d, "/unsfilter");
+	free(d);
+	if ((mkdir(c, 0700) != 0)&&(errno != EEXIST)) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setgid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setgid32), 0)) < 0) goto err_r;
+/* Where the child sends the listener with -D. */
+static int fake_sock = -1;
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setgroups), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setgroups32), 0)) < 0) goto err_r;
+/* Returns the listener fd for the user notifications, if fake. */
+static int apply_seccomp(char *policy, int use_cache, int optimize, int fake) {
+	int r = 0;
+	char *cfn = NULL;
+	char *cd = use_cache ? cache_dir() : NULL;
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setregid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setregid32), 0)) < 0) goto err_r;
+	if (cd) {
+		/* The key covers all that goes into the filter. */
+		uint64_t h = 0xcbf29ce484222325ULL;
+		const struct scmp_version *v = seccomp_version();
+		uint32_t k[6] = { fake ? 2 : 1, seccomp_arch_native(), optimize,
+			v ? v->major : 0, v ? v->minor : 0, fake ? fake_sock : 0 };
+		h = fnv1a(h, k, sizeof(k));
+		h = fnv1a(h, policy, strlen(policy));
+		if (asprintf(&cfn, "%s/%016llx.bpf", cd, (unsigned long long)h) < 0)
+			perror_msg_and_die("asprintf");
+		free(cd);
+		r = load_bpf(cfn, fake ? SECCOMP_FILTER_FLAG_NEW_LISTENER : 0);
+		if (r >= 0) {
+			free(cfn);
+			return fake ? r : -1;
+		}
+	}
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setresgid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setresgid32), 0)) < 0) goto err_r;
+	char *p = strdup(policy);
+	if (!p) perror_msg_and_die("strdup");
+	uint32_t def = policy_compile(NULL, p, fake, SCMP_ACT_ALLOW);
+	strcpy(p, policy);
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setresuid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setresuid32), 0)) < 0) goto err_r;
+	scmp_filter_ctx c = seccomp_init(def);
+	if (!c) error_msg_and_die("seccomp_init failed");
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setreuid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setreuid32), 0)) < 0) goto err_r;
+#if (SCMP_VER_MAJOR > 2)||((SCMP_VER_MAJOR == 2)&&(SCMP_VER_MINOR >= 5))
+	/* A binary tree of the syscalls instead of checking them one by one. */
+	if ((optimize > 1)&&((r = seccomp_attr_set(c, SCMP_FLTATR_CTL_OPTIMIZE, optimize)) < 0)) goto err_r;
+#endif
 
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setuid), 0)) < 0) goto err_r;
-	if ((r = seccomp_rule_add(c, SCMP_ACT_ERRNO(0), SCMP_SYS(setuid32), 0)) < 0) goto err_r;
+	policy_compile(c, p, fake, def);
+	free(p);
+	if (fake) {
+#if (SCMP_VER_MAJOR > 2)||((SCMP_VER_MAJOR == 2)&&(SCMP_VER_MINOR >= 5))
+		for (int i=0;fake_syscalls[i];i++) {
+			int nr = seccomp_syscall_resolve_name(fake_syscalls[i]);
+			if (nr == __NR_SCMP_ERROR) continue;
+			r = seccomp_rule_add(c, SCMP_ACT_NOTIFY, nr, 0);
+			if ((r < 0)&&(r != -EDOM)) goto err_r;
+		}
+		/* What the child does after the load to hand over the listener
+		 * has to get through a default that is not ALLOW. */
+		if (def != SCMP_ACT_ALLOW) {
+			if ((r = seccomp_rule_add(c, SCMP_ACT_ALLOW, SCMP_SYS(sendmsg), 1, SCMP_A0(SCMP_CMP_EQ, fake_sock))) < 0) goto err_r;
+			if ((r = seccomp_rule_add(c, SCMP_ACT_ALLOW, SCMP_SYS(close), 0)) < 0) goto err_r;
+		}
+#else
+		error_msg_and_die("-D needs libseccomp 2.5");
+#endif
+	}
+	if (cfn) {
+		/* Into a temporary file first, so that parallel runs dont see half of it. */
+		char *tfn;
+		if (asprintf(&tfn, "%s.%d", cfn, (int)getpid()) < 0) perror_msg_and_die("asprintf");
+		int fd = open(tfn, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+		if (fd >= 0) {
+			r = seccomp_export_bpf(c, fd);
+			close(fd);
+			if ((r < 0)||(rename(tfn, cfn) != 0)) unlink(tfn);
+		}
+		free(tfn);
+		free(cfn);
+	}
 
 	if ((r = seccomp_load(c)) < 0) goto err_r;
 
+	int lfd = -1;
+#if (SCMP_VER_MAJOR > 2)||((SCMP_VER_MAJOR == 2)&&(SCMP_VER_MINOR >= 5))
+	if ((fake)&&((lfd = seccomp_notify_fd(c)) < 0)) error_msg_and_die("no seccomp listener");
+#endif
 	seccomp_release(c);
-	return;
+	return lfd;
 
 err_r:
 	errno = -r;
 	perror_msg_and_die("seccomp");
+	return -1;
 }
 
-int main(int argc, char **argv) {
-	if (argc < 2) {
-		fprintf(stderr,"usage: %s <command> [parameters..]\n", argv[0]);
+/* Fake ownership (-D): chown and friends are done by us, the supervisor,
+ * via user notifications. The results go in a database of inode ->
+ * (uid, gid, mode), which the stat family is then made to agree with. */
+#define FDB_UID 1
+#define FDB_GID 2
+#define FDB_MODE 4
+
+struct fdb_ent {
+	uint64_t dev;
+	uint64_t ino;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mode;
+	uint32_t flags; /* FDB_*, 0 = empty slot */
+};
+
+struct fdb_hdr {
+	char magic[8];
+	uint32_t cap; /* power of 2 */
+	uint32_t count;
+};
+
+#define FDB_MAGIC "unsfdb1"
+static int fdb_fd = -1;
+static struct fdb_hdr *fdb;
+static struct fdb_ent *fdb_e;
+static uint32_t fdb_mcap; /* What we have mapped, the file might have grown since. */
+
+static void fdb_map(size_t cap) {
+	size_t sz = sizeof(*fdb) + cap * sizeof(*fdb_e);
+	if (fdb) munmap(fdb, sizeof(*fdb) + fdb_mcap * sizeof(*fdb_e));
+	fdb = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fdb_fd, 0);
+	if (fdb == MAP_FAILED) perror_msg_and_die("mmap");
+	fdb_e = (struct fdb_ent*)(fdb + 1);
+	fdb_mcap = cap;
+}
+
+/* Lock the database (how: LOCK_SH to look, LOCK_EX to change it) for one
+ * syscall, so that other runs on the same one can go on at the same
+ * time. If one of them grew it, map it again. */
+static void fdb_lock(int how) {
+	if (flock(fdb_fd, how) != 0) perror_msg_and_die("flock");
+	if (fdb->cap != fdb_mcap) fdb_map(fdb->cap);
+}
+
+/* The database is the file fn (locked while made or checked, and then
+ * for each syscall), or in memory if "-". */
+static void fdb_open(const char *fn) {
+	if (strcmp(fn, "-") == 0) fdb_fd = memfd_create("unsfdb", MFD_CLOEXEC);
+	else fdb_fd = open(fn, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fdb_fd < 0) perror_msg_and_die2("open", fn);
+	if (flock(fdb_fd, LOCK_EX) != 0) perror_msg_and_die2("flock", fn);
+
+	struct stat st;
+	if (fstat(fdb_fd, &st) != 0) perror_msg_and_die2("fstat", fn);
+	struct fdb_hdr h;
+	if (!st.st_size) {
+		memcpy(h.magic, FDB_MAGIC, 8);
+		h.cap = 4096;
+		h.count = 0;
+		if ((ftruncate(fdb_fd, sizeof(h) + h.cap * sizeof(*fdb_e)) != 0)||
+			(pwrite(fdb_fd, &h, sizeof(h), 0) != sizeof(h)))
+			perror_msg_and_die2("init", fn);
+	} else if ((pread(fdb_fd, &h, sizeof(h), 0) != sizeof(h))||(memcmp(h.magic, FDB_MAGIC, 8) != 0)||
+		(!h.cap)||(h.cap & (h.cap - 1))||(st.st_size < sizeof(h) + h.cap * sizeof(*fdb_e))) {
+		fprintf(stderr, "%s: not an unsfilter database\n", fn);
 		exit(1);
 	}
-	apply_seccomp();
-	run_prog(argv+1);
+	fdb_map(h.cap);
+	flock(fdb_fd, LOCK_UN);
+}
+
+static uint32_t fdb_hash(uint64_t dev, uint64_t ino) {
+	uint64_t h = (ino ^ (dev << 40) ^ (dev >> 24)) * 0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+/* Grow the table (and file) to twice the size and put the entries back. */
+static void fdb_grow(void) {
+	uint32_t cap = fdb->cap;
+	size_t esz = cap * sizeof(*fdb_e);
+	struct fdb_ent *old = malloc(esz);
+	if (!old) perror_msg_and_die("malloc");
+	memcpy(old, fdb_e, esz);
+	if (ftruncate(fdb_fd, sizeof(*fdb) + 2 * esz) != 0) perror_msg_and_die("ftruncate");
+	fdb_map(cap * 2);
+	fdb->cap = cap * 2;
+	memset(fdb_e, 0, 2 * esz);
+	for (uint32_t i=0;i<cap;i++) {
+		if (!old[i].flags) continue;
+		uint32_t j = fdb_hash(old[i].dev, old[i].ino) & (fdb->cap - 1);
+		while (fdb_e[j].flags) j = (j + 1) & (fdb->cap - 1);
+		fdb_e[j] = old[i];
+	}
+	free(old);
+}
+
+static struct fdb_ent *fdb_find(uint64_t dev, uint64_t ino, int add) {
+	if ((add)&&((fdb->count + 1) * 4 > fdb->cap * 3)) fdb_grow();
+	uint32_t j = fdb_hash(dev, ino) & (fdb->cap - 1);
+	for (;fdb_e[j].flags;j = (j + 1) & (fdb->cap - 1))
+		if ((fdb_e[j].dev == dev)&&(fdb_e[j].ino == ino)) return &fdb_e[j];
+	if (!add) return NULL;
+	/* The flags are set by the caller. */
+	fdb_e[j].dev = dev;
+	fdb_e[j].ino = ino;
+	fdb->count++;
+	return &fdb_e[j];
+}
+
+/* Read a string from the memory of the target. */
+static int target_str(int mfd, uint64_t addr, char *buf, int len) {
+	int l = 0;
+	while (l < len) {
+		/* Dont read over a page boundary that might not be there. */
+		int n = 4096 - ((addr + l) & 4095);
+		if (n > len - l) n = len - l;
+		int r = pread(mfd, buf + l, n, addr + l);
+		if (r <= 0) return -1;
+		char *z = memchr(buf + l, 0, r);
+		if (z) return 0;
+		l += r;
+	}
+	return -1;
+}
+
+/* Open (O_PATH) the file that pid means with (dirfd, path), path NULL for
+ * just dirfd. Returns the fd or -errno. Absolute paths are looked up from
+ * the root of pid; symlinks in them from ours. */
+static int target_open(pid_t pid, int dirfd, const char *path, int nofollow) {
+	char buf[48];
+	if ((path)&&(*path == '/')) {
+		snprintf(buf, sizeof(buf), "/proc/%d/root", (int)pid);
+		while (*path == '/') path++;
+		if (!*path) path = ".";
+	} else if ((!path)||(!*path)) {
+		if (dirfd == AT_FDCWD) snprintf(buf, sizeof(buf), "/proc/%d/cwd", (int)pid);
+		else snprintf(buf, sizeof(buf), "/proc/%d/fd/%d", (int)pid, dirfd);
+		path = NULL;
+	} else if (dirfd == AT_FDCWD) {
+		snprintf(buf, sizeof(buf), "/proc/%d/cwd", (int)pid);
+	} else {
+		snprintf(buf, sizeof(buf), "/proc/%d/fd/%d", (int)pid, dirfd);
+	}
+	int dfd = open(buf, O_PATH|O_CLOEXEC);
+	if ((dfd < 0)||(!path)) return dfd < 0 ? -errno : dfd;
+	int fd = openat(dfd, path, O_PATH|O_CLOEXEC|(nofollow ? O_NOFOLLOW : 0));
+	int e = errno;
+	close(dfd);
+	return fd < 0 ? -e : fd;
+}
+
+static void fake_stat(struct stat *st, struct fdb_ent *e) {
+	if (e->flags & FDB_UID) st->st_uid = e->uid;
+	if (e->flags & FDB_GID) st->st_gid = e->gid;
+	if (e->flags & FDB_MODE) st->st_mode = (st->st_mode & S_IFMT) | (e->mode & 07777);
+}
+
+/* Handle one notification. Returns 1 to let the kernel do the syscall. */
+static int fake_syscall(struct seccomp_notif *n, struct seccomp_notif_resp *resp, int lfd) {
+	char path[4096];
+	char pp[40];
+	__u64 *a = n->data.args;
+	int nr = n->data.nr;
+	int dirfd = AT_FDCWD, nofollow = 0, pa = -1, sa = -1, ua = -1, ma = -1;
+	int is_stat = 0;
+
+	/* Where the path (pa), the fd or dirfd, the stat buffer (sa) and the
+	 * uid/gid (ua, ua+1) or the mode (ma) are in the arguments. */
+	switch (nr) {
+#ifdef SYS_stat
+		case SYS_stat: pa = 0; sa = 1; is_stat = 1; break;
+#endif
+#ifdef SYS_lstat
+		case SYS_lstat: pa = 0; sa = 1; nofollow = 1; is_stat = 1; break;
+#endif
+#ifdef SYS_fstat
+		case SYS_fstat: dirfd = a[0]; sa = 1; is_stat = 1; break;
+#endif
+		case SYS_newfstatat:
+			dirfd = a[0]; pa = 1; sa = 2; is_stat = 1;
+			nofollow = (a[3] & AT_SYMLINK_NOFOLLOW) != 0;
+			break;
+		case SYS_statx:
+			dirfd = a[0]; pa = 1; sa = 4; is_stat = 2;
+			nofollow = (a[2] & AT_SYMLINK_NOFOLLOW) != 0;
+			break;
+#ifdef SYS_chown
+		case SYS_chown: pa = 0; ua = 1; break;
+#endif
+#ifdef SYS_lchown
+		case SYS_lchown: pa = 0; ua = 1; nofollow = 1; break;
+#endif
+		case SYS_fchown: dirfd = a[0]; ua = 1; break;
+		case SYS_fchownat:
+			dirfd = a[0]; pa = 1; ua = 2;
+			nofollow = (a[4] & AT_SYMLINK_NOFOLLOW) != 0;
+			break;
+#ifdef SYS_chmod
+		case SYS_chmod: pa = 0; ma = 1; break;
+#endif
+		case SYS_fchmod: dirfd = a[0]; ma = 1; break;
+		case SYS_fchmodat: dirfd = a[0]; pa = 1; ma = 2; break;
+#ifdef SYS_fchmodat2
+		case SYS_fchmodat2:
+			dirfd = a[0]; pa = 1; ma = 2;
+			nofollow = (a[3] & AT_SYMLINK_NOFOLLOW) != 0;
+			break;
+#endif
+		default: return 1;
+	}
+
+	snprintf(pp, sizeof(pp), "/proc/%d/mem", (int)n->pid);
+	int mfd = open(pp, O_RDWR|O_CLOEXEC);
+	if (mfd < 0) return 1;
+	int r = 1;
+	if ((pa >= 0)&&((!a[pa])||(target_str(mfd, a[pa], path, sizeof(path)) != 0))) goto out;
+
+	/* The pid is still the one that made the call (and its memory was read). */
+	if (ioctl(lfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &n->id) != 0) goto out;
+
+	int fd = target_open(n->pid, dirfd, pa >= 0 ? path : NULL, nofollow);
+	if (fd < 0) {
+		/* Let the kernel tell about the errors of the stat family. */
+		if (!is_stat) {
+			resp->error = fd;
+			r = 0;
+		}
+		goto out;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		goto out;
+	}
+	fdb_lock(ua >= 0 || ma >= 0 ? LOCK_EX : LOCK_SH);
+	struct fdb_ent *e = fdb_find(st.st_dev, st.st_ino, ua >= 0 || ma >= 0);
+
+	if (is_stat == 1) {
+		if (e) {
+			fake_stat(&st, e);
+			if (pwrite(mfd, &st, sizeof(st), a[sa]) == sizeof(st)) r = 0;
+			else resp->error = -EFAULT, r = 0;
+		}
+	} else if (is_stat == 2) {
+		struct statx sx;
+		if ((e)&&(statx(fd, "", AT_EMPTY_PATH|(a[2] & AT_STATX_SYNC_TYPE), a[3], &sx) == 0)) {
+			if (e->flags & FDB_UID) sx.stx_uid = e->uid;
+			if (e->flags & FDB_GID) sx.stx_gid = e->gid;
+			if (e->flags & FDB_MODE) sx.stx_mode = (sx.stx_mode & S_IFMT) | (e->mode & 07777);
+			if (pwrite(mfd, &sx, sizeof(sx), a[sa]) == sizeof(sx)) r = 0;
+			else resp->error = -EFAULT, r = 0;
+		}
+	} else if (ua >= 0) {
+		/* chown: just remember it. -1 is no change. */
+		uint32_t u = a[ua], g = a[ua+1];
+		if (!e->flags) {
+			e->uid = st.st_uid;
+			e->gid = st.st_gid;
+		}
+		if (u != (uint32_t)-1) e->uid = u, e->flags |= FDB_UID;
+		if (g != (uint32_t)-1) e->gid = g, e->flags |= FDB_GID;
+		r = 0;
+	} else {
+		/* chmod: do it, and remember it if it cant be done (or the mode
+		 * is faked already). Symlinks have no mode to change. */
+		uint32_t m = a[ma] & 07777;
+		snprintf(pp, sizeof(pp), "/proc/self/fd/%d", fd);
+		errno = 0;
+		if ((S_ISLNK(st.st_mode))&&(nofollow)) {
+			resp->error = -EOPNOTSUPP;
+		} else if ((chmod(pp, m) != 0)&&(errno != EPERM)) {
+			resp->error = -errno;
+		} else if ((e->flags & FDB_MODE)||(errno == EPERM)) {
+			e->mode = m;
+			e->flags |= FDB_MODE;
+		}
+		r = 0;
+	}
+	/* A new entry with nothing to remember after all (the chmod was done
+	 * for real) is given back. It was the first free slot on its chain,
+	 * so that can just stay free. */
+	if ((e)&&(!e->flags)) fdb->count--;
+	flock(fdb_fd, LOCK_UN);
+	close(fd);
+out:
+	close(mfd);
+	return r;
+}
+
+/* Serve the notifications from lfd until the child is gone.
+ * Returns the exit status for it. */
+static int fake_supervise(int lfd, pid_t chld) {
+	struct seccomp_notif_sizes sz;
+	if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sz) != 0)
+		perror_msg_and_die("seccomp(GET_NOTIF_SIZES)");
+	struct seccomp_notif *n = malloc(sz.seccomp_notif > sizeof(*n) ? sz.seccomp_notif : sizeof(*n));
+	struct seccomp_notif_resp *resp = malloc(sz.seccomp_notif_resp > sizeof(*resp) ? sz.seccomp_notif_resp : sizeof(*resp));
+	if ((!n)||(!resp)) perror_msg_and_die("malloc");
+
+	sigset_t chldm;
+	sigemptyset(&chldm);
+	sigaddset(&chldm, SIGCHLD);
+	int sfd = signalfd(-1, &chldm, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) perror_msg_and_die("signalfd");
+
+	for (;;) {
+		int st;
+		if (waitpid(chld, &st, WNOHANG) == chld) {
+			if (WIFEXITED(st)) return WEXITSTATUS(st);
+			return WIFSIGNALED(st) ? 128 + WTERMSIG(st) : 255;
+		}
+		struct pollfd pfd[2] = {
+			{ .fd = lfd, .events = POLLIN },
+			{ .fd = sfd, .events = POLLIN }
+		};
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror_msg_and_die("poll");
+		}
+		if (pfd[1].revents) {
+			struct signalfd_siginfo si;
+			while (read(sfd, &si, sizeof(si)) == sizeof(si));
+		}
+		if (!(pfd[0].revents & POLLIN)) continue;
+
+		memset(n, 0, sz.seccomp_notif);
+		if (ioctl(lfd, SECCOMP_IOCTL_NOTIF_RECV, n) != 0) continue; /* eg. the caller died */
+		memset(resp, 0, sz.seccomp_notif_resp);
+		resp->id = n->id;
+		if (fake_syscall(n, resp, lfd)) resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+		(void) ioctl(lfd, SECCOMP_IOCTL_NOTIF_SEND, resp);
+	}
+}
+
+/* Run the program with the filter, and serve its notifications. */
+static void fake_run(char *policy, int use_cache, int optimize, char **argv) {
+	int sp[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sp) != 0)
+		perror_msg_and_die("socketpair");
+
+	sigset_t chldm, omask;
+	sigemptyset(&chldm);
+	sigaddset(&chldm, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chldm, &omask);
+	pid_t chld = fork();
+	if (chld == -1) perror_msg_and_die("fork");
+	if (!chld) {
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+		close(sp[0]);
+		close(fdb_fd);
+		fake_sock = sp[1];
+		int lfd = apply_seccomp(policy, use_cache, optimize, 1);
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { .iov_base = "L", .iov_len = 1 };
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &lfd, sizeof(int));
+		if (sendmsg(sp[1], &mh, 0) != 1) perror_msg_and_die("sendmsg");
+		close(lfd);
+		close(sp[1]);
+		run_prog(argv);
+	}
+	close(sp[1]);
+
+	/* Like system(), leave these to the program. */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	char c;
+	int lfd = -1;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	if (recvmsg(sp[0], &mh, MSG_CMSG_CLOEXEC) == 1) {
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if ((cm)&&(cm->cmsg_type == SCM_RIGHTS))
+			memcpy(&lfd, CMSG_DATA(cm), sizeof(int));
+	}
+	close(sp[0]);
+	if (lfd < 0) {
+		/* The child failed before running the program, and told why. */
+		int st;
+		waitpid(chld, &st, 0);
+		exit(WIFEXITED(st) ? WEXITSTATUS(st) : 1);
+	}
+	exit(fake_supervise(lfd, chld));
+}
+
+void usage(char *name) {
+	fprintf(stderr,"usage: %s [options] <command> [parameters..]\n"
+		"\n\tOptions:"
+		"\n\t-f file\tLoad the rules from file (default: ignore chown and set*id)"
+		"\n\t-N\tDont cache the compiled filter"
+		"\n\t-O n\tlibseccomp filter layout: 1 = syscalls one by one, 2 = binary tree (default)"
+		"\n\t-D db\tFake chown/chmod, and the owners and modes seen by stat, keeping them in db (- = in memory)"
+	"\n\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	char *policy = (char*)default_policy;
+	int use_cache = 1;
+	int optimize = 2;
+	char *db = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+f:NO:D:")) != -1) {
+		switch (opt) {
+			default: usage(argv[0]); break;
+			case 'f': {
+				int fd = open(optarg, O_RDONLY|O_CLOEXEC);
+				if (fd < 0) perror_msg_and_die2("open", optarg);
+				policy = pfdreader(fd, NULL);
+				close(fd);
+				break;
+			}
+			case 'N': use_cache = 0; break;
+			case 'O': optimize = atoi(optarg); break;
+			case 'D': db = optarg; break;
+		}
+	}
+	if (argc - optind < 1) usage(argv[0]);
+
+	if (db) {
+		fdb_open(db);
+		fake_run(policy, use_cache, optimize, argv+optind);
+	}
+	apply_seccomp(policy, use_cache, optimize, 0);
+	run_prog(argv+optind);
 }